@@ -0,0 +1,121 @@
+/*
+File:   affinity.cpp
+Author: Hanson
+Desc:   Measure how many jobs the thread pool's workers steal across NUMA nodes under each affinity policy.
+.       Build with "make affinity", run with "build/affinity [workers] [rounds]"
+*/
+
+#include "ThreadPool/ThreadPool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+static const int SPAWN_DEPTH = 14;     // Each round is a binary tree of 2^15 - 1 jobs
+
+/*
+Function:   spawn
+Desc:       A job that does a little work, then queues two children on its worker's own deque. Idle
+.           workers get their jobs by stealing them
+Args:       pool: The pool to queue the children in
+.           depth: Levels left below this job
+*/
+static void spawn(ThreadPool *pool, int depth) {
+    volatile unsigned work = 0;
+    for (unsigned i = 0; i < 2000; i++) {
+        work = work + i;
+    }
+    if (depth > 0) {
+        pool->addJob([pool, depth] { spawn(pool, depth - 1); });
+        pool->addJob([pool, depth] { spawn(pool, depth - 1); });
+    }
+}
+
+/*
+Function:   workerNodes
+Desc:       Find the NUMA node each worker of a pool lands on, by pinning a scratch thread the same way
+Args:       policy: The pool's affinity policy
+.           workers: Number of workers
+Return:     The node of each worker, -1 for a worker that isn't pinned
+*/
+static std::vector<int> workerNodes(const affinityPolicy &policy, size_t workers) {
+    std::vector<int> nodes(workers, -1);
+    for (size_t i = 0; i < workers; i++) {
+        std::thread([&nodes, &policy, i] { nodes[i] = pinThread(policy, i); }).join();
+    }
+    return nodes;
+}
+
+/*
+Function:   blindRemoteShare
+Desc:       The share of steals that would cross nodes if thieves picked their victims at random, as
+.           they did before stealing became node-aware
+Args:       nodes: The node of each worker
+Return:     The share, 0 to 1
+*/
+static double blindRemoteShare(const std::vector<int> &nodes) {
+    double sum = 0;
+    for (size_t thief = 0; thief < nodes.size(); thief++) {
+        size_t remote = 0;
+        for (size_t victim = 0; victim < nodes.size(); victim++) {
+            if (victim != thief && nodes[victim] != nodes[thief]) {
+                remote++;
+            }
+        }
+        sum += nodes.size() > 1 ? (double)remote / (double)(nodes.size() - 1) : 0;
+    }
+    return nodes.empty() ? 0 : sum / (double)nodes.size();
+}
+
+int main(int argc, char *argv[]) {
+    size_t workers = argc > 1 ? (size_t)std::atoi(argv[1]) : std::thread::hardware_concurrency();
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 20;
+    const struct {
+        const char      *name;
+        affinityMode    mode;
+    } policies[] = {
+        { "none", AFFINITY_NONE },
+        { "compact", AFFINITY_COMPACT },
+        { "scatter", AFFINITY_SCATTER },
+    };
+
+    if (workers < 2) {
+        workers = 2;
+    }
+    printf("%zu workers, %d rounds of %d jobs\n", workers, rounds, (2 << SPAWN_DEPTH) - 1);
+    printf("%-8s %6s %10s %12s %8s %14s %8s\n",
+        "policy", "nodes", "steals", "remoteSteals", "remote", "random victim", "ms");
+    for (const auto &policy : policies) {
+        affinityPolicy affinity;
+        affinity.mode = policy.mode;
+        std::vector<int> nodes = workerNodes(affinity, workers);
+        std::vector<int> distinct;
+        for (int node : nodes) {
+            if (node >= 0 && std::find(distinct.begin(), distinct.end(), node) == distinct.end()) {
+                distinct.push_back(node);
+            }
+        }
+
+        ThreadPool pool;
+        pool.init(workers, 0, affinity);
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            pool.addJob([&pool] { spawn(&pool, SPAWN_DEPTH); });
+            pool.waitForAllJobsDone();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        poolStats stats = pool.getStats();
+        pool.shutdown();
+
+        printf("%-8s %6zu %10llu %12llu %7.1f%% %13.1f%% %8lld\n", policy.name, distinct.size(),
+            stats.steals, stats.remoteSteals,
+            stats.steals != 0 ? 100.0 * (double)stats.remoteSteals / (double)stats.steals : 0.0,
+            100.0 * blindRemoteShare(nodes),
+            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+    }
+    printf("\"remote\" is the share of steals that crossed nodes, \"random victim\" the share expected if\n"
+        "thieves ignored the nodes. Unpinned workers and single-node machines never count remote steals\n");
+    return 0;
+}
@@ -5,6 +5,10 @@ Desc:   Implement functionalities for the REST server
 */ 
 
 #include "RESTserver.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
 
 static void builtInHandler(mg_connection *connection, int ev, mg_http_message *ev_data, void *fn_data);
 static void httpRequestDispatch(struct mg_connection *connection, int ev, void *ev_data, void *fn_data);
@@ -25,28 +29,72 @@ std::string ucase(std::string& target) {
 handler_identifier RESTserver::addHandler(std::string method, std::string path, handler eventHandler) {
     handlerInfo info;
     info.eventHandler = eventHandler;
+    info.asyncEventHandler = (asyncHandler)NULL;
+    info.priority = PRIORITY_NORMAL;
+    info.coroutineEventHandler = (coroutineHandler)NULL;
+    info.maxQueueWait = 0;
     info.method = ucase(method);
     return this->router.insert(std::pair<std::string, handlerInfo>(path, info));
 }
 
+handler_identifier RESTserver::addAsyncHandler(std::string method, std::string path, asyncHandler eventHandler,
+    jobPriority priority, unsigned maxQueueWait) {
+    handlerInfo info;
+    info.eventHandler = (handler)NULL;
+    info.asyncEventHandler = eventHandler;
+    info.priority = priority;
+    info.coroutineEventHandler = (coroutineHandler)NULL;
+    info.maxQueueWait = maxQueueWait;
+    info.method = ucase(method);
+    if (maxQueueWait != 0 && this->threadPool != NULL) {
+        this->threadPool->trackQueueWait();
+    }
+    return this->router.insert(std::pair<std::string, handlerInfo>(path, info));
+}
+
+void RESTserver::setThreadPool(ThreadPool *pool) {
+    this->threadPool = pool;
+    // The budget check on every request only reads the estimate, the monitor measuring it runs already
+    for (const auto &route : this->router) {
+        if (route.second.maxQueueWait != 0 && pool != NULL) {
+            pool->trackQueueWait();
+            break;
+        }
+    }
+}
+
+void RESTserver::setRetryAfter(unsigned seconds) {
+    this->retryAfter = seconds;
+}
+
+/*
+Function:   shed
+Desc:       For internal use only. Answer a request the thread pool can't take in time with the prebuilt
+.           503 Service Unavailable, without copying the request or formatting a response
+Args:       connection: The connection to reply to
+*/
+void RESTserver::shed(mg_connection *connection) {
+    mg_send(connection, this->overloadResponse.data(), this->overloadResponse.size());
+}
+
 void RESTserver::removeHandler(handler_identifier identifier) {
     this->router.erase(identifier.first);
 }
 
 void RESTserver::setDefaultHandler(handler eventHandler) {
-    this->defaultHandler = { "", eventHandler };
+    this->defaultHandler = { "", eventHandler, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
 }
 
 void RESTserver::removeDefaultHandler() {
-    this->defaultHandler = { "", (handler)NULL };
+    this->defaultHandler = { "", (handler)NULL, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
 }
 
 void RESTserver::setPollHandler(handler pollHandler) {
-    this->pollHandler = { "", pollHandler };
+    this->pollHandler = { "", pollHandler, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
 }
 
 void RESTserver::removePollHandler() {
-    this->pollHandler = { "", (handler)NULL };
+    this->pollHandler = { "", (handler)NULL, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
 }
 
 /*
@@ -65,22 +113,681 @@ handler RESTserver::getPollHandler() {
 }
 
 void RESTserver::setWrongMethodHandler(handler eventHandler) {
-    this->wrongMethodHandler = { "", eventHandler };
+    this->wrongMethodHandler = { "", eventHandler, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
 }
 
 
 void RESTserver::removeWrongMethodHandler() {
-    this->wrongMethodHandler = { "", (handler)NULL };
+    this->wrongMethodHandler = { "", (handler)NULL, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
+}
+
+/*
+Function:   releaseBody
+Desc:       Free a response body queued by reply, once it has been sent or the connection is closed
+Args:       body: The std::string holding the body
+*/
+static void releaseBody(void *body) {
+    delete static_cast<std::string *>(body);
+}
+
+void RESTserver::reply(mg_connection *connection, int statusCode, const std::string &headers, std::string body) {
+    mg_printf(connection, "HTTP/1.1 %d OK\r\n%sContent-Length: %lu\r\n\r\n",
+        statusCode, headers.c_str(), (unsigned long)body.size());
+    // mg_send_ref copies anything shorter than MG_IO_SIZE anyway, so only keep large bodies alive
+    if (body.size() < MG_IO_SIZE) {
+        mg_send(connection, body.data(), body.size());
+        return;
+    }
+    std::string *ownedBody = new std::string(std::move(body));
+    mg_send_ref(connection, ownedBody->data(), ownedBody->size(), releaseBody, ownedBody);
+}
+
+// A response produced on another thread, on its way to the event loop
+struct pendingReply : mg_completion {
+    int         statusCode;
+    std::string headers;
+    std::string body;
+};
+
+/*
+Function:   sendPendingReply
+Desc:       Runs on the event loop. Send a response passed to complete, or drop it if the connection is gone
+Args:       connection: The connection to reply to, NULL if it has been closed
+.           completion: The pendingReply
+*/
+static void sendPendingReply(mg_connection *connection, mg_completion *completion) {
+    pendingReply *pending = static_cast<pendingReply *>(completion);
+    if (connection != NULL) {
+        RESTserver::reply(connection, pending->statusCode, pending->headers, std::move(pending->body));
+    }
+    delete pending;
 }
 
-void RESTserver::startServer(std::string connectionString, int pollFrequency, void *userdata) {
+void RESTserver::complete(mg_mgr *mgr, unsigned long connectionId, int statusCode, std::string headers, std::string body) {
+    pendingReply *pending = new pendingReply();
+    pending->conn_id = connectionId;
+    pending->fn = sendPendingReply;
+    pending->statusCode = statusCode;
+    pending->headers = std::move(headers);
+    pending->body = std::move(body);
+    mg_complete(mgr, pending);
+}
+
+// A request handed to an asyncHandler on the thread pool. It comes back to the event loop as a completion
+struct asyncJob : mg_completion {
+    mg_mgr              *mgr;
+    std::string         raw;            // Copy of the whole request message
+    mg_http_message     request;        // Points into raw
+    asyncHandler        eventHandler;
+    void                *userdata;
+    asyncResponse       response;
+    dispatcherInfo      *info;
+    std::atomic<bool>   cancelled{false};   // Set by the event loop if the client has gone away
+};
+
+/*
+Function:   rebase
+Desc:       Point a string of a parsed request into the copy of the request
+Args:       str: A string of the original request
+.           from: Start of the original request
+.           to: Start of the copy
+.           len: Length of the request
+*/
+static void rebase(struct mg_str &str, const char *from, const char *to, size_t len) {
+    if (str.ptr >= from && str.ptr + str.len <= from + len) {
+        str.ptr = to + (str.ptr - from);
+    }
+    else {
+        str = mg_str_n(NULL, 0);
+    }
+}
+
+/*
+Function:   copyRequest
+Desc:       Copy a request, so that it outlives the connection's receive buffer
+Args:       raw: Receives the whole request message
+.           copy: Receives the parsed request, with every string pointing into raw
+.           request: The parsed request to copy
+*/
+static void copyRequest(std::string &raw, mg_http_message &copy, const mg_http_message *request) {
+    const char *from = request->message.ptr;
+    size_t len = request->message.len;
+
+    raw.assign(from, len);
+    copy = *request;
+
+    // Every string of the request points into the copy, which stays put while it lives
+    const char *to = raw.data();
+    rebase(copy.method, from, to, len);
+    rebase(copy.uri, from, to, len);
+    rebase(copy.query, from, to, len);
+    rebase(copy.proto, from, to, len);
+    for (size_t i = 0; i < MG_MAX_HTTP_HEADERS && copy.headers[i].name.len > 0; i++) {
+        rebase(copy.headers[i].name, from, to, len);
+        rebase(copy.headers[i].value, from, to, len);
+    }
+    rebase(copy.body, from, to, len);
+    rebase(copy.head, from, to, len);
+    rebase(copy.chunk, from, to, len);
+    rebase(copy.message, from, to, len);
+}
+
+/*
+Function:   finishAsyncJob
+Desc:       Runs on the event loop. Send the response of an asyncJob and read the connection's next request
+Args:       connection: The connection to reply to, NULL if it has been closed
+.           completion: The asyncJob
+*/
+static void finishAsyncJob(mg_connection *connection, mg_completion *completion) {
+    asyncJob *task = static_cast<asyncJob *>(completion);
+    task->info->pendingJobs.erase(task->conn_id);
+    task->info->outstandingJobs--;
+    if (connection != NULL) {
+        RESTserver::reply(connection, task->response.statusCode, task->response.headers, std::move(task->response.body));
+        mg_http_resume(connection);
+    }
+    delete task;
+}
+
+/*
+Function:   callAsyncHandler
+Desc:       Call an asyncHandler, turning an exception into 500 Internal Server Error
+Args:       eventHandler: The handler
+.           request: The request
+.           response: The response to fill in
+.           userdata: Passed to startServer
+*/
+static void callAsyncHandler(asyncHandler eventHandler, mg_http_message *request, asyncResponse *response, void *userdata) {
+    try {
+        eventHandler(request, response, userdata);
+    }
+    catch (...) {
+        response->statusCode = 500;
+        response->headers.clear();
+        response->body = "Internal server error";
+    }
+}
+
+/*
+Function:   runAsyncJob
+Desc:       Runs on a thread pool worker. Call the asyncHandler of an asyncJob, then hand it back to the event loop
+Args:       arg: The asyncJob
+*/
+static void runAsyncJob(void *arg) {
+    asyncJob *task = static_cast<asyncJob *>(arg);
+    if (!task->cancelled) {
+        callAsyncHandler(task->eventHandler, &task->request, &task->response, task->userdata);
+    }
+    mg_complete(task->mgr, task);
+}
+
+void RESTserver::offload(mg_connection *connection, mg_http_message *request, const handlerInfo &route, void *fn_data) {
+    dispatcherInfo *info = (dispatcherInfo *)fn_data;
+
+    if (this->threadPool == NULL) {
+        // No thread pool, answer right here, in order with the connection's other requests
+        asyncResponse response = { 200, "", "" };
+        callAsyncHandler(route.asyncEventHandler, request, &response, info->userdata);
+        RESTserver::reply(connection, response.statusCode, response.headers, std::move(response.body));
+        return;
+    }
+
+    // Over budget, turn the request away before copying it
+    if (route.maxQueueWait != 0 &&
+        this->threadPool->estimateQueueWait() > route.maxQueueWait * 1000ULL) {
+        this->shed(connection);
+        return;
+    }
+
+    asyncJob *task = new asyncJob();
+
+    task->conn_id = connection->id;
+    task->fn = finishAsyncJob;
+    task->mgr = connection->mgr;
+    copyRequest(task->raw, task->request, request);
+    task->eventHandler = route.asyncEventHandler;
+    task->userdata = info->userdata;
+    task->response.statusCode = 200;
+    task->info = info;
+
+    if (!this->threadPool->addJob([task] { runAsyncJob(task); }, route.priority)) {
+        // The lane is full
+        delete task;
+        this->shed(connection);
+        return;
+    }
+
+    // Stop parsing pipelined requests until the response is back
+    connection->is_suspended = 1;
+    info->pendingJobs[connection->id] = task;
+    info->outstandingJobs++;
+}
+
+#if defined(__cpp_impl_coroutine)
+// The event loop running on this thread, if any. Tells the awaitables whether they can act right away
+static thread_local mg_mgr *currentLoop = NULL;
+
+// The connection whose handler is being called, see asyncTask::promise_type::operator new
+static thread_local requestContext *frameSource = NULL;
+
+// What a requestContext asks of its event loop when it is passed there with mg_complete
+enum coroutineAction {
+    ACTION_RESUME,      // Resume the coroutine
+    ACTION_SLEEP,       // Arm the timer for sleepFor milliseconds, then resume the coroutine
+    ACTION_FETCH,       // Send pendingFetch, then resume the coroutine with the response
+    ACTION_FINISH       // The handler has returned, send its response
+};
+
+// Put in front of every coroutine frame. owner is the requestContext that keeps the memory, or NULL
+typedef struct alignas(std::max_align_t) _frameHeader {
+    requestContext *owner;
+} frameHeader;
+
+void *asyncTask::promise_type::operator new(size_t size) {
+    requestContext *owner = frameSource;
+    frameHeader *header;
+
+    frameSource = NULL;     // Coroutines the handler calls get their own memory
+    if (owner == NULL) {
+        header = (frameHeader *)malloc(sizeof(frameHeader) + size);
+    }
+    else {
+        // The handler of a connection, reuse the memory of its previous one
+        if (owner->frameSize < size) {
+            free(owner->frame);
+            owner->frame = malloc(sizeof(frameHeader) + size);
+            owner->frameSize = owner->frame != NULL ? size : 0;
+        }
+        header = (frameHeader *)owner->frame;
+    }
+    if (header == NULL) {
+        throw std::bad_alloc();
+    }
+    header->owner = owner;
+    return header + 1;
+}
+
+void asyncTask::promise_type::operator delete(void *frame, size_t size) {
+    frameHeader *header = (frameHeader *)frame - 1;
+    if (header->owner == NULL) {
+        free(header);
+    }
+}
+
+requestContext::~requestContext() {
+    mg_timer_free(&this->timer);
+    free(this->frame);
+}
+
+static void resumeCoroutine(requestContext *context);
+static bool startFetch(requestContext *context);
+
+std::coroutine_handle<> asyncTask::finalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+    promise_type &promise = handle.promise();
+
+    if (promise.continuation) {
+        // Go on with the coroutine that awaits this one
+        return promise.continuation;
+    }
+    requestContext *context = promise.context;
+    if (context != NULL) {
+        if (currentLoop == context->mgr) {
+            // resumeCoroutine sends the response once this returns
+            context->finished = true;
+        }
+        else {
+            // The frame may be gone as soon as the event loop has it, don't touch it after this
+            context->action = ACTION_FINISH;
+            mg_complete(context->mgr, context);
+        }
+    }
+    return std::noop_coroutine();
+}
+
+bool requestContext::loopAwaiter::await_ready() const noexcept {
+    return currentLoop == this->context->mgr;
+}
+
+void requestContext::loopAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    this->context->suspended = handle;
+    this->context->action = ACTION_RESUME;
+    mg_complete(this->context->mgr, this->context);
+}
+
+/*
+Function:   timerFired
+Desc:       Runs on the event loop. Resume a coroutine whose sleep is over
+Args:       arg: The requestContext
+*/
+static void timerFired(void *arg) {
+    resumeCoroutine((requestContext *)arg);
+}
+
+void requestContext::timerAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    requestContext *context = this->context;
+
+    context->suspended = handle;
+    if (currentLoop == context->mgr) {
+        mg_timers_add(&context->mgr->timers, &context->timer, (int)this->ms, 0, timerFired, context);
+    }
+    else {
+        context->sleepFor = this->ms;
+        context->action = ACTION_SLEEP;
+        mg_complete(context->mgr, context);
+    }
+}
+
+bool requestContext::fetchAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    requestContext *context = this->context;
+
+    context->suspended = handle;
+    context->pendingFetch = this;
+    if (currentLoop == context->mgr) {
+        // Go on right away if the request could not be sent
+        return startFetch(context);
+    }
+    context->action = ACTION_FETCH;
+    mg_complete(context->mgr, context);
+    return true;
+}
+
+/*
+Function:   fetchEvent
+Desc:       Runs on the event loop. The event handler of the connection sending a requestContext's pendingFetch
+Args:       connection: Mongoose connection
+.           ev: Event type
+.           ev_data: Event data
+.           fn_data: The requestContext, NULL once its coroutine has been resumed
+*/
+static void fetchEvent(struct mg_connection *connection, int ev, void *ev_data, void *fn_data) {
+    requestContext *context = (requestContext *)fn_data;
+
+    if (context == NULL) {
+        return;
+    }
+    requestContext::fetchAwaiter *fetch = context->pendingFetch;
+    if (ev == MG_EV_CONNECT) {
+        struct mg_str host = mg_url_host(fetch->url.c_str());
+        mg_printf(connection,
+            "%s %s HTTP/1.1\r\n"
+            "Host: %.*s\r\n"
+            "Connection: close\r\n"
+            "Content-Length: %lu\r\n"
+            "%s"
+            "\r\n",
+            fetch->method.c_str(), mg_url_uri(fetch->url.c_str()), (int)host.len, host.ptr,
+            (unsigned long)fetch->body.size(), fetch->headers.c_str());
+        mg_send(connection, fetch->body.data(), fetch->body.size());
+    }
+    else if (ev == MG_EV_HTTP_MSG) {
+        // On a response, the parsed uri is the status code
+        struct mg_http_message *response = (struct mg_http_message *)ev_data;
+        const char *headers = (const char *)memchr(response->head.ptr, '\n', response->head.len);
+        size_t headersEnd = response->body.ptr - response->head.ptr;
+
+        fetch->result.statusCode = atoi(std::string(response->uri.ptr, response->uri.len).c_str());
+        fetch->result.headers.clear();
+        if (headers != NULL && (size_t)(headers + 1 - response->head.ptr) < headersEnd) {
+            // The header lines, without the status line and the empty line after them
+            fetch->result.headers.assign(headers + 1, response->head.ptr + headersEnd - (headers + 1));
+            while (fetch->result.headers.size() >= 4 &&
+                fetch->result.headers.compare(fetch->result.headers.size() - 4, 4, "\r\n\r\n") == 0) {
+                fetch->result.headers.resize(fetch->result.headers.size() - 2);
+            }
+        }
+        fetch->result.body.assign(response->body.ptr, response->body.len);
+        connection->is_closing = 1;
+        connection->fn_data = NULL;
+        context->fetching = false;
+        resumeCoroutine(context);
+    }
+    else if (ev == MG_EV_ERROR) {
+        fetch->result.body = (const char *)ev_data;
+    }
+    else if (ev == MG_EV_CLOSE) {
+        // No response
+        fetch->result.statusCode = 0;
+        if (fetch->result.body.empty()) {
+            fetch->result.body = "Connection closed";
+        }
+        connection->fn_data = NULL;
+        context->fetching = false;
+        resumeCoroutine(context);
+    }
+}
+
+/*
+Function:   startFetch
+Desc:       Runs on the event loop. Connect to send a requestContext's pendingFetch
+Args:       context: The requestContext
+Return:     false if the connection could not be made, the result is set then
+*/
+static bool startFetch(requestContext *context) {
+    requestContext::fetchAwaiter *fetch = context->pendingFetch;
+
+    fetch->result = { 0, "", "" };
+    if (mg_http_connect(context->mgr, fetch->url.c_str(), fetchEvent, context) == NULL) {
+        fetch->result.body = "Cannot connect to " + fetch->url;
+        return false;
+    }
+    context->fetching = true;
+    return true;
+}
+
+/*
+Function:   completeCoroutine
+Desc:       Runs on the event loop. Send the response of a finished handler and read the connection's next request
+Args:       context: The requestContext of the handler
+*/
+static void completeCoroutine(requestContext *context) {
+    struct mg_connection *connection = mg_conn_by_id(context->mgr, context->conn_id);
+    std::exception_ptr error = context->handle.promise().error;
+
+    context->handle.destroy();
+    context->handle = nullptr;
+    context->suspended = nullptr;
+    context->finished = false;
+    if (context->closed) {
+        context->info->contexts.erase(context->conn_id);
+        delete context;
+        return;
+    }
+    if (connection == NULL || connection->is_closing) {
+        return;
+    }
+    if (error) {
+        context->response.statusCode = 500;
+        context->response.headers.clear();
+        context->response.body = "Internal server error";
+    }
+    RESTserver::reply(connection, context->response.statusCode, context->response.headers,
+        std::move(context->response.body));
+    if (context->starting) {
+        // Still in the dispatcher, which goes on with pipelined requests
+        connection->is_suspended = 0;
+    }
+    else {
+        mg_http_resume(connection);
+    }
+}
+
+/*
+Function:   resumeCoroutine
+Desc:       Runs on the event loop. Resume a requestContext's coroutine, and send the response if the handler returns
+Args:       context: The requestContext
+*/
+static void resumeCoroutine(requestContext *context) {
+    context->suspended.resume();
+    if (context->finished) {
+        completeCoroutine(context);
+    }
+}
+
+/*
+Function:   runCoroutineAction
+Desc:       Runs on the event loop. Do what a requestContext passed with mg_complete asks for
+Args:       connection: The connection, NULL if it has been closed
+.           completion: The requestContext
+*/
+static void runCoroutineAction(mg_connection *connection, mg_completion *completion) {
+    requestContext *context = static_cast<requestContext *>(completion);
+
+    switch (context->action) {
+    case ACTION_RESUME:
+        resumeCoroutine(context);
+        break;
+    case ACTION_SLEEP:
+        mg_timers_add(&context->mgr->timers, &context->timer, (int)context->sleepFor, 0, timerFired, context);
+        break;
+    case ACTION_FETCH:
+        if (!startFetch(context)) {
+            resumeCoroutine(context);
+        }
+        break;
+    case ACTION_FINISH:
+        completeCoroutine(context);
+        break;
+    }
+}
+
+/*
+Function:   parkedOnLoop
+Desc:       Whether a requestContext's handler is waiting for its own event loop, for a timer or a fetch,
+.           rather than running or on its way to a thread pool or to the loop
+Args:       context: The requestContext
+*/
+static bool parkedOnLoop(const requestContext *context) {
+    return context->timer.wheel != NULL || context->fetching;
+}
+
+/*
+Function:   destroyCoroutines
+Desc:       Runs on the event loop when it stops. Destroy the handlers waiting for the loop, which won't
+.           resume them anymore, and delete every context
+Args:       mgr: The event loop
+.           info: Its dispatcherInfo
+WARNING:    Every handler must be parked on the loop or done, see parkedOnLoop
+*/
+static void destroyCoroutines(mg_mgr *mgr, dispatcherInfo *info) {
+    for (struct mg_connection *connection = mgr->conns; connection != NULL; connection = connection->next) {
+        if (connection->fn == fetchEvent) {
+            // Its handler is destroyed below, mg_mgr_free closes it quietly
+            connection->fn_data = NULL;
+        }
+    }
+    for (auto &entry : info->contexts) {
+        requestContext *context = entry.second;
+        mg_timer_free(&context->timer);
+        if (context->handle) {
+            context->handle.destroy();
+        }
+        delete context;
+    }
+    info->contexts.clear();
+}
+
+handler_identifier RESTserver::addCoroutineHandler(std::string method, std::string path, coroutineHandler eventHandler) {
+    handlerInfo info;
+    info.eventHandler = (handler)NULL;
+    info.asyncEventHandler = (asyncHandler)NULL;
+    info.priority = PRIORITY_NORMAL;
+    info.coroutineEventHandler = eventHandler;
+    info.maxQueueWait = 0;
+    info.method = ucase(method);
+    return this->router.insert(std::pair<std::string, handlerInfo>(path, info));
+}
+
+void RESTserver::startCoroutine(mg_connection *connection, mg_http_message *request, const handlerInfo &route, void *fn_data) {
+    dispatcherInfo *info = (dispatcherInfo *)fn_data;
+    requestContext *&context = info->contexts[connection->id];
+
+    if (context == NULL) {
+        // The connection's first coroutine handler. The context stays for the next ones
+        context = new requestContext();
+        context->conn_id = connection->id;
+        context->fn = runCoroutineAction;
+        context->mgr = connection->mgr;
+        context->info = info;
+        context->userdata = info->userdata;
+    }
+    copyRequest(context->raw, context->copy, request);
+    context->request = &context->copy;
+    context->response = { 200, "", "" };
+
+    // The handler starts suspended, its frame comes from the context
+    frameSource = context;
+    try {
+        context->handle = route.coroutineEventHandler(*context).release();
+    }
+    catch (...) {
+        frameSource = NULL;
+        RESTserver::reply(connection, 500, "", "Internal server error");
+        return;
+    }
+    frameSource = NULL;
+    context->handle.promise().context = context;
+    context->suspended = context->handle;
+
+    // Stop parsing pipelined requests until the response is sent
+    connection->is_suspended = 1;
+    context->starting = true;
+    resumeCoroutine(context);
+    context->starting = false;
+}
+#endif
+
+/*
+Function:   awayFromLoop
+Desc:       Whether an event loop still has work out on the thread pool, or on its way back through its
+.           completion queue: asyncJobs, and coroutine handlers that are neither done nor waiting for the loop
+Args:       info: The event loop's dispatcherInfo
+*/
+static bool awayFromLoop(dispatcherInfo *info) {
+    if (info->outstandingJobs != 0) {
+        return true;
+    }
+#if defined(__cpp_impl_coroutine)
+    for (auto &entry : info->contexts) {
+        if (entry.second->handle && !parkedOnLoop(entry.second)) {
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+unsigned long RESTserver::millis(const mg_connection *connection) {
+    return connection->mgr->now;
+}
+
+void RESTserver::setReactorCount(size_t reactorCount) {
+    this->reactorCount = reactorCount == 0 ? 1 : reactorCount;
+}
+
+void RESTserver::setListenBacklog(int backlog) {
+    this->listenBacklog = backlog;
+}
+
+void RESTserver::setAcceptBudget(int acceptBudget) {
+    this->acceptBudget = acceptBudget;
+}
+
+void RESTserver::setSocketOptions(const mg_sockopts &options) {
+    this->socketOptions = options;
+}
+
+void RESTserver::setTimeouts(const mg_timeouts &timeouts) {
+    this->timeouts = timeouts;
+}
+
+void RESTserver::startServer(std::string connectionString, int pollFrequency, void *userdata,
+    const affinityPolicy &affinity) {
+    std::vector<std::thread> reactors;
+
+    // Extra event loops. The calling thread runs the first one
+    this->affinity = affinity;
+    this->overloadResponse =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: " + std::to_string(this->retryAfter) + "\r\n"
+        "Content-Length: 19\r\n"
+        "\r\n"
+        "Service unavailable";
+    for (size_t i = 1; i < this->reactorCount; i++) {
+        reactors.emplace_back(&RESTserver::runReactor, this, i, connectionString, pollFrequency, userdata);
+    }
+    this->runReactor(0, connectionString, pollFrequency, userdata);
+    for (auto &reactor : reactors) {
+        reactor.join();
+    }
+}
+
+/*
+Function:   runReactor
+Desc:       For internal use only. Run one event loop with its own mg_mgr until the server is stopped.
+.           The thread is pinned first, so the connections' buffers are allocated on its NUMA node
+Args:       index: The event loop's position, used to place it
+.           connectionString: The address to listen
+.           pollFrequency: The frequency to invoke poll event. In milliseconds. The event loop wakes up
+.                          earlier when a timer armed on it (mgr->timers) is due
+.           userdata: A pointer to user-defined data
+*/
+void RESTserver::runReactor(size_t index, std::string connectionString, int pollFrequency, void *userdata) {
     struct mg_mgr mgr;
     dispatcherInfo info;
 
+    pinThread(this->affinity, index);
     info.ptrToClass = this;
     info.userdata = userdata;
 
     mg_mgr_init(&mgr);
+#if defined(__cpp_impl_coroutine)
+    currentLoop = &mgr;
+#endif
+    mgr.reuseport = this->reactorCount > 1;     // Every event loop listens on the same address
+    mgr.backlog = this->listenBacklog;
+    mgr.accept_budget = this->acceptBudget;
+    mgr.sockopts = this->socketOptions;
+    mgr.timeouts = this->timeouts;
     mg_http_listen(&mgr, connectionString.c_str(), httpRequestDispatch, &info);
 
     for (;;) {
@@ -89,7 +796,32 @@ void RESTserver::startServer(std::string connectionString, int pollFrequency, vo
         }
         mg_mgr_poll(&mgr, pollFrequency);
     }
+
+    // Jobs still on the thread pool hand their asyncJob back to mgr, which must outlive them. Skip the
+    // ones no worker has picked up, and wait for the others. Their responses are dropped
+    for (struct mg_connection *connection = mgr.conns; connection != NULL; connection = connection->next) {
+        connection->is_closing = 1;
+    }
+    for (auto &pending : info.pendingJobs) {
+        pending.second->cancelled = true;
+    }
+#if defined(__cpp_impl_coroutine)
+    for (auto &entry : info.contexts) {
+        entry.second->gone = true;
+    }
+#endif
+    while (awayFromLoop(&info)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        mg_completions_run(&mgr);
+    }
+#if defined(__cpp_impl_coroutine)
+    // The handlers left wait for a timer or a fetch, which mg_mgr_free drops
+    destroyCoroutines(&mgr, &info);
+#endif
     mg_mgr_free(&mgr);
+#if defined(__cpp_impl_coroutine)
+    currentLoop = NULL;
+#endif
 }
 
 void RESTserver::stopServer() {
@@ -101,26 +833,26 @@ Function:   matchHandler
 Desc:       For internal use only. Matches the provided method and path with the corresponding handler
 Args:       method: Parsed method string from the HTTP message
 .           path: Parsed path string from the HTTP message
-Return:     A handler function that is guaranteed not NULL
+Return:     The router info. Either its eventHandler or its asyncEventHandler is guaranteed not NULL
 */
-handler RESTserver::matchHandler(std::string method, std::string path) {
+handlerInfo RESTserver::matchHandler(std::string method, std::string path) {
     auto info = this->router.find(path);        // Find corresponding request handler
 
     if (info != this->router.end()) {
         // There's a corresponding entry in the router
         if (info->second.method.at(0) == '\0' || ucase(method) == info->second.method) {
             // The request method matches
-            return info->second.eventHandler;
+            return info->second;
         }
         else {
             // The request method does not match
             if (this->wrongMethodHandler.eventHandler) {
                 // There's a user-set wrong method handler
-                return this->wrongMethodHandler.eventHandler;
+                return this->wrongMethodHandler;
             }
             else {
                 // No user-set wrong method handler, use the built-in function instead
-                return builtInHandler;
+                return { "", builtInHandler, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
             }
         }
     }
@@ -128,11 +860,11 @@ handler RESTserver::matchHandler(std::string method, std::string path) {
         // No corresponding entry in the router
         if (this->defaultHandler.eventHandler) {
             // There's a user-set default handler
-            return this->defaultHandler.eventHandler;
+            return this->defaultHandler;
         }
         else {
             // No user-set default handler, use the built-in function instead
-            return builtInHandler;
+            return { "", builtInHandler, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
         }
     }
 }
@@ -169,12 +901,48 @@ static void httpRequestDispatch(struct mg_connection *connection, int ev, void *
         // Handle HTTP request
         struct mg_http_message *httpMsg = (struct mg_http_message *)ev_data;
 
-        // Find a matching handler and call it
-        auto handler = ptrToClass->matchHandler(
+        // Find a matching handler and call it, or hand it to the thread pool
+        auto info = ptrToClass->matchHandler(
             std::string(httpMsg->method.ptr, httpMsg->method.len),
             std::string(httpMsg->uri.ptr, httpMsg->uri.len)
         );
-        handler(connection, ev, (mg_http_message *)ev_data, fn_data);
+        if (info.asyncEventHandler) {
+            ptrToClass->offload(connection, httpMsg, info, fn_data);
+        }
+#if defined(__cpp_impl_coroutine)
+        else if (info.coroutineEventHandler) {
+            ptrToClass->startCoroutine(connection, httpMsg, info, fn_data);
+        }
+#endif
+        else {
+            info.eventHandler(connection, ev, (mg_http_message *)ev_data, fn_data);
+        }
+    }
+    else if (ev == MG_EV_CLOSE) {
+        if (connection->is_suspended) {
+            // The client has gone away, don't run its job if no worker has picked it up yet
+            auto &pendingJobs = ((dispatcherInfo *)fn_data)->pendingJobs;
+            auto pending = pendingJobs.find(connection->id);
+            if (pending != pendingJobs.end()) {
+                pending->second->cancelled = true;
+                pendingJobs.erase(pending);
+            }
+        }
+#if defined(__cpp_impl_coroutine)
+        auto &contexts = ((dispatcherInfo *)fn_data)->contexts;
+        auto context = contexts.find(connection->id);
+        if (context != contexts.end()) {
+            if (context->second->handle) {
+                // The handler runs to its end, and deletes the context then
+                context->second->gone = true;
+                context->second->closed = true;
+            }
+            else {
+                delete context->second;
+                contexts.erase(context);
+            }
+        }
+#endif
     }
     else if (ev == MG_EV_POLL) {
         // Handle poll event
@@ -14,18 +14,208 @@ extern "C" {
 }
 #endif
 
+#include "../ThreadPool/ThreadPool.hpp"
+#include <atomic>
 #include <map>
 #include <string>
+#include <unordered_map>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#endif
 
 // handler type is for the server event handlers
 typedef void (*handler)(mg_connection *connection, int ev, mg_http_message *ev_data, void *fn_data);
 
+// The response of an asyncHandler, sent by the event loop once the handler returns
+typedef struct _asyncResponse {
+    int         statusCode;     // HTTP status code. Default is 200
+    std::string headers;        // Extra headers, each one terminated with "\r\n"
+    std::string body;           // Response body
+} asyncResponse;
+
+// asyncHandler type is for handlers that run on the thread pool, see addAsyncHandler
+typedef void (*asyncHandler)(mg_http_message *request, asyncResponse *response, void *userdata);
+
+class asyncTask;
+class requestContext;
+
+// coroutineHandler type is for handlers that are C++20 coroutines, see addCoroutineHandler
+typedef asyncTask (*coroutineHandler)(requestContext &context);
+
 // For internal use only. Stores router info, including method and event handler
 typedef struct _handlerInfo {
-    std::string method;         // Empty string ("") means method will be ignored
-    handler     eventHandler;   // Remember to check for NULL function pointers
+    std::string     method;             // Empty string ("") means method will be ignored
+    handler         eventHandler;       // Remember to check for NULL function pointers
+    asyncHandler    asyncEventHandler;  // If not NULL, run on the thread pool instead of eventHandler
+    jobPriority     priority;           // Thread pool lane of asyncEventHandler
+    coroutineHandler coroutineEventHandler;    // If not NULL, started as a coroutine instead of eventHandler
+    unsigned        maxQueueWait;       // Queue wait budget of asyncEventHandler in milliseconds, 0 means none
 } handlerInfo;
 
+#if defined(__cpp_impl_coroutine)
+/*
+Class:  asyncTask
+Desc:   The return type of coroutine handlers, see RESTserver::addCoroutineHandler. A coroutine returning
+.       asyncTask starts when it's awaited, so a handler can also co_await helper coroutines of its own.
+.       An exception thrown in one is rethrown where it's awaited
+*/
+class asyncTask {
+public:
+    struct promise_type;
+
+    // For internal use only. Continues the awaiting coroutine, or hands a finished handler to its event loop
+    struct finalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        std::coroutine_handle<> continuation;       // The coroutine awaiting this one, if any
+        requestContext          *context = NULL;    // Set for a handler started by the server
+        std::exception_ptr      error;
+
+        asyncTask get_return_object() {
+            return asyncTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        finalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { this->error = std::current_exception(); }
+
+        // The frame of a handler comes from its connection, see requestContext
+        static void *operator new(size_t size);
+        static void operator delete(void *frame, size_t size);
+    };
+
+    asyncTask(asyncTask &&other) noexcept : handle(other.handle) {
+        other.handle = nullptr;
+    }
+    asyncTask(const asyncTask &) = delete;
+    asyncTask &operator=(const asyncTask &) = delete;
+
+    ~asyncTask() {
+        if (this->handle) {
+            this->handle.destroy();
+        }
+    }
+
+    // co_await another asyncTask: run it and continue once it's done
+    bool await_ready() const noexcept {
+        return !this->handle || this->handle.done();
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        this->handle.promise().continuation = awaiting;
+        return this->handle;
+    }
+    void await_resume() {
+        if (this->handle && this->handle.promise().error) {
+            std::rethrow_exception(this->handle.promise().error);
+        }
+    }
+
+    // For internal use only. Take the coroutine out of the task, which no longer destroys it
+    std::coroutine_handle<promise_type> release() {
+        std::coroutine_handle<promise_type> released = this->handle;
+        this->handle = nullptr;
+        return released;
+    }
+
+private:
+    explicit asyncTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+/*
+Class:  requestContext
+Desc:   What a coroutine handler works with: the request, the response to fill in, and awaitables that
+.       continue the handler on the connection's event loop. A connection keeps its context and the
+.       memory of its handler's coroutine frame from one request to the next, so a keep-alive connection
+.       runs coroutine handlers without allocating. The response is sent once the handler returns
+.       E.g. asyncTask handleSlow(requestContext &context) {
+.                co_await threadPool.schedule();                 // Now on a worker
+.                std::string result = compute();
+.                co_await context.sleep(100);                    // Back on the event loop 100 ms later
+.                asyncResponse upstream = co_await context.fetch("http://127.0.0.1:9000/data");
+.                context.response.body = result + upstream.body;
+.            }
+*/
+class requestContext : public mg_completion {
+public:
+    mg_http_message *request;       // Copy of the request, valid until the handler returns
+    asyncResponse   response;       // Sent once the handler returns. statusCode is 200 unless changed
+    void            *userdata;      // Passed to startServer
+
+    // Whether the client has gone away. The handler still runs to its end, but nothing is sent
+    bool cancelled() const {
+        return this->gone.load(std::memory_order_relaxed);
+    }
+
+    // co_await context.resumeOnLoop(): continue on the connection's event loop, e.g. after
+    // threadPool.schedule(). Does nothing when already there
+    struct loopAwaiter {
+        requestContext *context;
+        bool await_ready() const noexcept;
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept {}
+    };
+    loopAwaiter resumeOnLoop() {
+        return loopAwaiter{ this };
+    }
+
+    // co_await context.sleep(ms): continue on the event loop after ms milliseconds. The wait is a timer
+    // on the loop's timer wheel, no thread is blocked meanwhile
+    struct timerAwaiter {
+        requestContext  *context;
+        unsigned        ms;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept {}
+    };
+    timerAwaiter sleep(unsigned ms) {
+        return timerAwaiter{ this, ms };
+    }
+
+    // asyncResponse upstream = co_await context.fetch(url): send an HTTP request with mg_http_connect and
+    // continue on the event loop with the response. headers are extra request headers, each one
+    // terminated with "\r\n". The result's headers are the response's header lines. If there's no
+    // response, statusCode is 0 and body says why
+    struct fetchAwaiter {
+        requestContext  *context;
+        std::string     url, method, headers, body;
+        asyncResponse   result;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        asyncResponse await_resume() { return std::move(this->result); }
+    };
+    fetchAwaiter fetch(std::string url, std::string method = "GET", std::string headers = "", std::string body = "") {
+        return fetchAwaiter{ this, std::move(url), std::move(method), std::move(headers), std::move(body), {} };
+    }
+
+    // For internal use only. The handler's state, owned by the event loop
+    mg_mgr                  *mgr;
+    struct _dispatcherInfo  *info;          // Of the event loop, which lists the context until it's deleted
+    std::string             raw;            // Copy of the whole request message
+    mg_http_message         copy;           // Points into raw
+    std::coroutine_handle<asyncTask::promise_type> handle;     // The running handler, if any
+    std::coroutine_handle<> suspended;      // The coroutine to resume, the handler or one it awaits
+    std::atomic<bool>       gone{false};    // The client has gone away
+    bool                    closed = false; // The connection is closed, delete the context with the handler
+    bool                    starting = false;   // The handler runs for the first time, from the dispatcher
+    bool                    finished = false;   // The handler has returned on the event loop
+    int                     action = 0;     // What to do on the event loop when the completion runs
+    mg_timer                timer{};        // See sleep
+    unsigned                sleepFor = 0;
+    fetchAwaiter            *pendingFetch = NULL;
+    bool                    fetching = false;   // pendingFetch is on its way, the loop resumes the handler
+    void                    *frame = NULL;  // Memory of the handler's coroutine frame, kept for the next one
+    size_t                  frameSize = 0;
+
+    ~requestContext();
+};
+#endif
+
 // handler_identifier can be used to remove router rules
 typedef std::pair<std::map<std::string, handlerInfo>::iterator, bool> handler_identifier;
 
@@ -39,6 +229,44 @@ public:
     */
     handler_identifier addHandler(std::string method, std::string path, handler eventHandler);
 
+    /*
+    Function:   addAsyncHandler
+    Desc:       Add a new rule into the router, whose handler runs on the thread pool set with setThreadPool.
+    .           The request is copied for the handler, and the response it fills in is sent by the event loop
+    Args:       method: The request method. Case insensitive. e.g.: POST, GET
+    .           eventHandler: A handler function. It gets the request, the response to fill in, and the
+    .                         userdata passed to startServer
+    .           priority: Optional. The thread pool lane to run in. Give interactive routes PRIORITY_HIGH
+    .                     and bulk routes PRIORITY_LOW. Default is PRIORITY_NORMAL
+    .           maxQueueWait: Optional. In milliseconds. While the thread pool estimates that a new job waits
+    .                         longer than this before a worker picks it up, requests are turned away instead
+    .                         of queued, see ThreadPool::estimateQueueWait. Default is 0, which means no budget
+    Return:     A handler_identifier, which can be used to remove the rule with removeHandler()
+    Note:       The connection reads no further requests until the response is sent, so responses to pipelined
+    .           requests stay in order. If the route's lane is full or its budget is exceeded, the client gets
+    .           503 Service Unavailable with Retry-After at once, see setRetryAfter. If the client disconnects
+    .           before a worker picks the request up, the handler is not called
+    WARNING:    The handler runs on a worker thread. Don't touch the server or the connection from it
+    */
+    handler_identifier addAsyncHandler(std::string method, std::string path, asyncHandler eventHandler,
+        jobPriority priority = PRIORITY_NORMAL, unsigned maxQueueWait = 0);
+
+    /*
+    Function:   setThreadPool
+    Desc:       Set the thread pool that runs the handlers added with addAsyncHandler. Without one, they
+    .           run on the event loop
+    Args:       pool: An initialized thread pool. It must outlive the server
+    */
+    void setThreadPool(ThreadPool *pool);
+
+    /*
+    Function:   setRetryAfter
+    Desc:       Set the Retry-After of the 503 Service Unavailable sent when the thread pool turns a request
+    .           away, see addAsyncHandler. The response is built once, when the server starts
+    Args:       seconds: When the client should try again. Default is 1
+    */
+    void setRetryAfter(unsigned seconds);
+
     /*
     Function:   removeHandler
     Desc:       Remove a rule from the router
@@ -73,8 +301,65 @@ public:
     */
     void removeWrongMethodHandler();
 
+    /*
+    Function:   reply
+    Desc:       Send an HTTP response. A body of MG_IO_SIZE bytes or more is handed to the kernel straight
+    .           from its string, without being copied into the connection's send buffer. Smaller ones are copied
+    Args:       connection: The connection to reply to
+    .           statusCode: HTTP status code. e.g.: 200
+    .           headers: Extra headers, each one terminated with "\r\n". Can be empty
+    .           body: Response body. Pass std::move(yourString) to avoid copying it
+    */
+    static void reply(mg_connection *connection, int statusCode, const std::string &headers, std::string body);
+
+    /*
+    Function:   complete
+    Desc:       Send an HTTP response from another thread, e.g. from a thread pool job. The response is
+    .           passed to the connection's event loop, which wakes up at once to send it
+    Args:       mgr: The connection's event loop, connection->mgr
+    .           connectionId: The connection's ID, connection->id
+    .           statusCode: HTTP status code. e.g.: 200
+    .           headers: Extra headers, each one terminated with "\r\n". Can be empty
+    .           body: Response body
+    WARNING:    Don't touch the mg_connection itself from another thread. If the client has gone away by the
+    .           time the response arrives, the response is dropped
+    */
+    static void complete(mg_mgr *mgr, unsigned long connectionId, int statusCode, std::string headers, std::string body);
+
+    /*
+    Function:   millis
+    Desc:       Get the event loop's monotonic clock. It is read once per poll, so this costs nothing
+    .           and every handler called in the same poll sees the same value
+    Args:       connection: A connection of the event loop
+    Return:     Milliseconds since an arbitrary point in the past. Does not jump with the wall clock
+    */
+    static unsigned long millis(const mg_connection *connection);
+
     // For internal use only. Matches the provided method and path with the corresponding handler
-    handler matchHandler(std::string method, std::string path);
+    handlerInfo matchHandler(std::string method, std::string path);
+
+    // For internal use only. Run an asyncHandler for the request on the thread pool
+    void offload(mg_connection *connection, mg_http_message *request, const handlerInfo &info, void *fn_data);
+
+#if defined(__cpp_impl_coroutine)
+    /*
+    Function:   addCoroutineHandler
+    Desc:       Add a new rule into the router, whose handler is a C++20 coroutine. It starts on the event
+    .           loop, can co_await threadPool.schedule() to continue on a worker, and co_await the
+    .           awaitables of its requestContext to continue on the event loop after a timer or an outbound
+    .           HTTP request. The response it fills in is sent by the event loop once it returns
+    Args:       method: The request method. Case insensitive. e.g.: POST, GET
+    .           eventHandler: A coroutine taking the requestContext and returning asyncTask
+    Return:     A handler_identifier, which can be used to remove the rule with removeHandler()
+    Note:       The connection reads no further requests until the response is sent, so responses to pipelined
+    .           requests stay in order. An exception thrown by the handler sends 500 Internal Server Error
+    WARNING:    Needs C++20, e.g. make DEFINES=-std=c++20. Don't touch the server or the connection from a worker
+    */
+    handler_identifier addCoroutineHandler(std::string method, std::string path, coroutineHandler eventHandler);
+
+    // For internal use only. Start a coroutine handler for the request
+    void startCoroutine(mg_connection *connection, mg_http_message *request, const handlerInfo &info, void *fn_data);
+#endif
 
     /*
     Function:   setPollHandler
@@ -91,35 +376,115 @@ public:
 
     // For internal use only. Obtain the handler function for poll event
     handler getPollHandler();
+
+    /*
+    Function:   setReactorCount
+    Desc:       Set the number of event loop threads used by startServer
+    Args:       reactorCount: Number of event loops. Each one owns its own mg_mgr and
+    .                         a SO_REUSEPORT listener, the kernel spreads new connections
+    .                         between them. Default is 1, which runs a single event loop
+    .                         on the thread that calls startServer
+    WARNING:    With more than one event loop, handlers are called from several threads
+    .           at the same time and must be thread-safe
+    */
+    void setReactorCount(size_t reactorCount);
+
+    /*
+    Function:   setListenBacklog
+    Desc:       Set the listen() backlog, the number of connections the kernel queues before
+    .           they are accepted. Default is 128
+    Args:       backlog: Queue length. The kernel caps it at net.core.somaxconn
+    */
+    void setListenBacklog(int backlog);
+
+    /*
+    Function:   setAcceptBudget
+    Desc:       Set how many pending connections an event loop accepts per poll. A larger budget
+    .           drains connection storms faster, a smaller one leaves more time for requests
+    .           on established connections. Default is 64
+    Args:       acceptBudget: Max connections accepted per poll
+    */
+    void setAcceptBudget(int acceptBudget);
+
+    /*
+    Function:   setSocketOptions
+    Desc:       Set the TCP options applied to the listener and the connections it accepts
+    Args:       options: See struct mg_sockopts. Defaults are TCP_NODELAY and TCP_QUICKACK on,
+    .                    keep-alive probes after 60 seconds idle, every 20 seconds, 3 times
+    */
+    void setSocketOptions(const mg_sockopts &options);
+
+    /*
+    Function:   setTimeouts
+    Desc:       Set how long a client may take before its connection is closed. A request head or body
+    .           that does not arrive in time is answered with 408 Request Timeout. By default all of them
+    .           are off and the server never closes a connection on its own
+    Args:       timeouts: See struct mg_timeouts. In milliseconds, 0 disables one. E.g. { 10000, 60000,
+    .                     60000, 30000 }: 10 seconds for the request head, 60 seconds for the body, 60 seconds
+    .                     idle between requests and 30 seconds without any progress sending a response
+    WARNING:    A handler that answers later (e.g. from the thread pool) leaves the connection idle meanwhile,
+    .           keep the idle timeout above its longest run time
+    */
+    void setTimeouts(const mg_timeouts &timeouts);
     
     /*
     Function:   startServer
     Desc:       Start the server
     Args:       connectionString: The address to listen. E.g. localhost:8000
-    .           pollFrequency: The frequency to invoke poll event. In milliseconds
+    .           pollFrequency: The frequency to invoke poll event. In milliseconds. The event loop wakes up
+    .                          earlier when a timer armed on it (mgr->timers) is due
     .           userdata: A pointer to user-defined data
-    WARNING:    This is a blocking operation. The function won't return until the server is stopped
+    .           affinity: Optional. Where to pin the event loop threads, see affinityPolicy. Default is not
+    .                     to pin them. Pin them next to the thread pool's workers, e.g. both on the same
+    .                     NUMA node, so requests and the jobs made from them stay in local memory
+    WARNING:    This is a blocking operation. The function won't return until the server is stopped.
+    .           The calling thread runs the first event loop, see setReactorCount. It stays pinned
+    .           after the function returns
     */
-    void startServer(std::string connectionString, int pollFrequency, void *userdata);
+    void startServer(std::string connectionString, int pollFrequency, void *userdata,
+        const affinityPolicy &affinity = affinityPolicy());
     
     /*
     Function:   stopServer
-    Desc:       Stop the server
+    Desc:       Stop the server. Each event loop first waits for its jobs that are still on the thread pool
+    WARNING:    Keep the thread pool running until startServer returns
     */
     void stopServer();
 
 private:
     std::map<std::string, handlerInfo> router;
-    handlerInfo defaultHandler = { "", (handler)NULL };
-    handlerInfo wrongMethodHandler = { "", (handler)NULL };
-    handlerInfo pollHandler = { "", (handler)NULL };
+    handlerInfo defaultHandler = { "", (handler)NULL, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
+    handlerInfo wrongMethodHandler = { "", (handler)NULL, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
+    handlerInfo pollHandler = { "", (handler)NULL, (asyncHandler)NULL, PRIORITY_NORMAL, (coroutineHandler)NULL, 0 };
+    ThreadPool *threadPool = NULL;
+    size_t reactorCount = 1;
+    int listenBacklog = MG_LISTEN_BACKLOG;
+    int acceptBudget = MG_ACCEPT_BUDGET;
+    mg_sockopts socketOptions = { true, true, 60, 20, 3 };
+    mg_timeouts timeouts = { 0, 0, 0, 0 };
+    affinityPolicy affinity;
+    unsigned retryAfter = 1;
 
-    // If the server is stopping
-    bool stopping = false;
+    // The 503 Service Unavailable sent when the thread pool turns a request away. Built by startServer
+    std::string overloadResponse;
+
+    // If the server is stopping. Read by every event loop thread
+    std::atomic<bool> stopping{false};
+
+    // Runs one event loop until the server is stopped
+    void runReactor(size_t index, std::string connectionString, int pollFrequency, void *userdata);
+
+    // Turn a request away with overloadResponse
+    void shed(mg_connection *connection);
 };
 
+struct asyncJob;
+
 // For internal use only. Stores HTTP request dispatcher info, including pointer to current class and user-defined data
 typedef struct _dispatcherInfo {
     RESTserver  *ptrToClass;
     void        *userdata;
+    std::unordered_map<unsigned long, asyncJob *> pendingJobs;  // Jobs on the thread pool, by connection ID
+    size_t      outstandingJobs = 0;    // Jobs not back from the thread pool, including those of closed connections
+    std::unordered_map<unsigned long, requestContext *> contexts;   // Of connections that ran a coroutine handler
 } dispatcherInfo;
@@ -21,6 +21,15 @@
 #line 1 "src/private.h"
 #endif
 void mg_connect_resolved(struct mg_connection *);
+void mg_completions_run(struct mg_mgr *);
+bool mg_send_pending(struct mg_connection *);
+
+#if MG_ENABLE_FILE_CACHE
+char *mg_http_etag(char *buf, size_t len, mg_stat_t *st);
+bool mg_fcache_serve(struct mg_connection *c, struct mg_http_message *hm,
+                     const char *path, const char *mime, const char *hdrs);
+void mg_fcache_free(struct mg_mgr *mgr);
+#endif
 
 #if MG_ARCH == MG_ARCH_FREERTOS
 static inline void *mg_calloc(int cnt, size_t size) {
@@ -370,7 +379,7 @@ static void mg_sendnsreq(struct mg_connection *c, struct mg_str *name, int ms,
     d->txnid = s_reqs ? s_reqs->txnid + 1 : 1;
     d->next = s_reqs;
     s_reqs = d;
-    d->expire = mg_millis() + ms;
+    d->expire = c->mgr->now + ms;
     d->c = c;
     c->is_resolving = 1;
     LOG(LL_VERBOSE_DEBUG, ("%lu resolving %.*s, txnid %hu", c->id,
@@ -414,6 +423,266 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
   c->is_closing = 1;
 }
 
+#ifdef MG_ENABLE_LINES
+#line 1 "src/fcache.c"
+#endif
+
+
+
+#if MG_ENABLE_FILE_CACHE
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+
+#define MG_FCACHE_BUCKETS 256
+
+// One cached response. A small file is kept in `buf` right behind the
+// headers, so the whole response goes out as a single buffer
+struct mg_fcache_entry {
+  struct mg_fcache_entry *next;  // Hash chain
+  unsigned long hash;            // Hash of path, mime and hdrs
+  const char *path, *mime, *hdrs;  // Lookup key, stored after the struct
+  int wd;                        // inotify watch on the file
+  char etag[64];                 // mg_http_etag() of the file
+  char *buf;                     // Response headers, then resident body
+  size_t hdr_len;                // Length of the headers in buf
+  void *map;                     // mmap()-ed body, or NULL if resident
+  size_t size;                   // Body length
+  unsigned refs;                 // One for the cache, one per send in flight
+};
+
+struct mg_fcache {
+  struct mg_fcache_entry *buckets[MG_FCACHE_BUCKETS];
+  struct mg_connection *watcher;  // The inotify descriptor
+  size_t count;                   // Number of cached entries
+};
+
+static unsigned long mg_fcache_hash(const char *path, const char *mime,
+                                    const char *hdrs) {
+  const char *parts[] = {path, mime, hdrs}, *p;
+  unsigned long h = 2166136261UL;
+  size_t i;
+  for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+    for (p = parts[i]; *p != '\0'; p++) {
+      h = (h ^ (unsigned char) *p) * 16777619UL;
+    }
+    h = (h ^ 0xff) * 16777619UL;  // Separator, so "ab"+"c" != "a"+"bc"
+  }
+  return h;
+}
+
+static void mg_fcache_unref(void *arg) {
+  struct mg_fcache_entry *e = (struct mg_fcache_entry *) arg;
+  if (--e->refs > 0) return;  // Still being sent, the last send frees it
+  if (e->map != NULL) munmap(e->map, e->size);
+  free(e->buf);
+  free(e);
+}
+
+// Forget the entries of one inotify watch, or all of them if wd is -1
+static void mg_fcache_drop(struct mg_fcache *fc, int wd) {
+  size_t i;
+  for (i = 0; i < MG_FCACHE_BUCKETS; i++) {
+    struct mg_fcache_entry **p = &fc->buckets[i], *e;
+    while ((e = *p) != NULL) {
+      if (wd == -1 || e->wd == wd) {
+        *p = e->next;
+        fc->count--;
+        mg_fcache_unref(e);
+      } else {
+        p = &e->next;
+      }
+    }
+  }
+}
+
+static void mg_fcache_cb(struct mg_connection *c, int ev, void *ev_data,
+                         void *fn_data) {
+  struct mg_fcache *fc = (struct mg_fcache *) fn_data;
+  if (ev == MG_EV_READ) {
+    size_t ofs = 0;
+    while (ofs + sizeof(struct inotify_event) <= c->recv.len) {
+      struct inotify_event *ie = (struct inotify_event *) (c->recv.buf + ofs);
+      if (ofs + sizeof(*ie) + ie->len > c->recv.len) break;
+      // On overflow events were lost, nothing can be trusted any more
+      mg_fcache_drop(fc, ie->mask & IN_Q_OVERFLOW ? -1 : ie->wd);
+      if (!(ie->mask & (IN_IGNORED | IN_Q_OVERFLOW))) {
+        inotify_rm_watch((int) (long) c->fd, ie->wd);  // Re-added on reload
+      }
+      ofs += sizeof(*ie) + ie->len;
+    }
+    mg_iobuf_delete(&c->recv, ofs);
+  } else if (ev == MG_EV_CLOSE) {
+    fc->watcher = NULL;
+    mg_fcache_drop(fc, -1);  // Changes cannot be seen any more
+  }
+  (void) ev_data;
+}
+
+static struct mg_fcache *mg_fcache_get(struct mg_mgr *mgr) {
+  struct mg_fcache *fc = (struct mg_fcache *) mgr->fcache;
+  if (fc == NULL &&
+      (fc = (struct mg_fcache *) calloc(1, sizeof(*fc))) != NULL) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 ||
+        (fc->watcher = mg_watch_fd(mgr, fd, mg_fcache_cb, fc)) == NULL) {
+      LOG(LL_ERROR, ("inotify: %d, file cache disabled", errno));
+      if (fd >= 0) close(fd);
+    }
+    mgr->fcache = fc;
+  }
+  return fc != NULL && fc->watcher != NULL ? fc : NULL;
+}
+
+// Remove a watch that no cached entry uses. Watches are per inode, so an
+// entry for the same file with other headers may still depend on it
+static void mg_fcache_unwatch(struct mg_fcache *fc, int wd) {
+  size_t i;
+  struct mg_fcache_entry *e;
+  for (i = 0; i < MG_FCACHE_BUCKETS; i++) {
+    for (e = fc->buckets[i]; e != NULL; e = e->next) {
+      if (e->wd == wd) return;
+    }
+  }
+  inotify_rm_watch((int) (long) fc->watcher->fd, wd);
+}
+
+// Read a file into a new entry. Only regular files that fit are watched.
+// The path is stat-ed again once the watch is in place, and the body is
+// read after that, so a change made while loading still drops the entry
+static struct mg_fcache_entry *mg_fcache_load(struct mg_fcache *fc,
+                                              const char *path,
+                                              const char *mime,
+                                              const char *hdrs,
+                                              unsigned long hash) {
+  const char *fmt =
+      "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+      "Etag: %s\r\nContent-Length: " MG_INT64_FMT "\r\n%s\r\n";
+  size_t plen = strlen(path) + 1, mlen = strlen(mime) + 1;
+  struct mg_fcache_entry *e = NULL;
+  mg_stat_t st, st2;
+  size_t size, got = 0;
+  int fd, wd, n;
+
+  if (fc->count >= MG_FILE_CACHE_MAX_ENTRIES) return NULL;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size > MG_FILE_CACHE_MMAP_MAX ||
+      (e = (struct mg_fcache_entry *) calloc(
+           1, sizeof(*e) + plen + mlen + strlen(hdrs) + 1)) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  if ((wd = inotify_add_watch((int) (long) fc->watcher->fd, path,
+                              IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                  IN_DELETE_SELF | IN_MOVE_SELF)) < 0) {
+    free(e);
+    close(fd);
+    return NULL;
+  }
+  // Changed or replaced between the first fstat() and the watch, nothing
+  // reports that. The watch follows the path, so look the path up again
+  if (stat(path, &st2) != 0 || st2.st_dev != st.st_dev ||
+      st2.st_ino != st.st_ino || st2.st_size != st.st_size ||
+      st2.st_mtime != st.st_mtime) {
+    mg_fcache_unwatch(fc, wd);
+    free(e);
+    close(fd);
+    return NULL;
+  }
+  size = (size_t) st.st_size;
+  e->path = (char *) (e + 1);
+  e->mime = e->path + plen;
+  e->hdrs = e->mime + mlen;
+  strcpy((char *) e->path, path);
+  strcpy((char *) e->mime, mime);
+  strcpy((char *) e->hdrs, hdrs);
+  e->hash = hash;
+  e->wd = wd;
+  e->size = size;
+  e->refs = 1;
+  mg_http_etag(e->etag, sizeof(e->etag), &st);
+  n = snprintf(NULL, 0, fmt, mime, e->etag, (int64_t) size, hdrs);
+  e->hdr_len = n < 0 ? 0 : (size_t) n;
+  // Resident bodies go right behind the headers, over snprintf()'s NUL
+  e->buf = (char *) malloc(e->hdr_len + 1 +
+                           (size <= MG_FILE_CACHE_RESIDENT_MAX ? size : 0));
+  if (e->buf != NULL) {
+    snprintf(e->buf, e->hdr_len + 1, fmt, mime, e->etag, (int64_t) size, hdrs);
+    if (size <= MG_FILE_CACHE_RESIDENT_MAX) {
+      ssize_t r;
+      while (got < size &&
+             (r = read(fd, e->buf + e->hdr_len + got, size - got)) > 0) {
+        got += (size_t) r;
+      }
+    } else if ((e->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+               MAP_FAILED) {
+      e->map = NULL;
+    } else {
+      got = size;
+    }
+  }
+  close(fd);
+  if (e->buf == NULL || got != size) {
+    mg_fcache_unref(e);
+    mg_fcache_unwatch(fc, wd);
+    return NULL;
+  }
+  e->next = fc->buckets[hash % MG_FCACHE_BUCKETS];
+  fc->buckets[hash % MG_FCACHE_BUCKETS] = e;
+  fc->count++;
+  LOG(LL_DEBUG, ("cached %s, %lu bytes%s", path, (unsigned long) size,
+                 e->map != NULL ? ", mmap" : ""));
+  return e;
+}
+
+// Serve a file from the cache, loading it on a miss. Returns false if the
+// file cannot be cached, mg_http_serve_file() then serves it from disk
+bool mg_fcache_serve(struct mg_connection *c, struct mg_http_message *hm,
+                     const char *path, const char *mime, const char *hdrs) {
+  struct mg_fcache *fc = mg_fcache_get(c->mgr);
+  struct mg_fcache_entry *e = NULL;
+  struct mg_str *inm;
+  unsigned long h;
+
+  if (fc == NULL) return false;
+  if (hdrs == NULL) hdrs = "";
+  h = mg_fcache_hash(path, mime, hdrs);
+  for (e = fc->buckets[h % MG_FCACHE_BUCKETS]; e != NULL; e = e->next) {
+    if (e->hash == h && strcmp(e->path, path) == 0 &&
+        strcmp(e->mime, mime) == 0 && strcmp(e->hdrs, hdrs) == 0) {
+      break;
+    }
+  }
+  if (e == NULL && (e = mg_fcache_load(fc, path, mime, hdrs, h)) == NULL) {
+    return false;
+  }
+  inm = mg_http_get_header(hm, "If-None-Match");
+  if (inm != NULL && mg_vcasecmp(inm, e->etag) == 0) {
+    mg_printf(c, "HTTP/1.1 304 Not Modified\r\nContent-Length: 0\r\n\r\n");
+  } else if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
+    mg_send(c, e->buf, e->hdr_len);
+  } else if (e->map == NULL) {
+    e->refs++;
+    mg_send_ref(c, e->buf, e->hdr_len + e->size, mg_fcache_unref, e);
+  } else {
+    e->refs++;
+    mg_send(c, e->buf, e->hdr_len);
+    mg_send_ref(c, e->map, e->size, mg_fcache_unref, e);
+  }
+  return true;
+}
+
+void mg_fcache_free(struct mg_mgr *mgr) {
+  struct mg_fcache *fc = (struct mg_fcache *) mgr->fcache;
+  if (fc != NULL) {
+    mg_fcache_drop(fc, -1);
+    free(fc);
+    mgr->fcache = NULL;
+  }
+}
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/http.c"
 #endif
@@ -655,8 +924,11 @@ void mg_http_reply(struct mg_connection *c, int code, const char *headers,
   va_end(ap);
   mg_printf(c, "HTTP/1.1 %d OK\r\n%sContent-Length: %d\r\n\r\n", code,
             headers == NULL ? "" : headers, len);
-  mg_send(c, buf, len);
-  if (buf != mem) free(buf);
+  if (buf != mem) {
+    mg_send_ref(c, buf, len, free, buf);  // Hand the heap buffer over as is
+  } else {
+    mg_send(c, buf, len);
+  }
 }
 
 #if MG_ENABLE_FS
@@ -699,8 +971,11 @@ int mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
   }
 }
 
+static void mg_http_deadline(struct mg_connection *c, int ev);
+
 static void static_cb(struct mg_connection *c, int ev, void *ev_data,
                       void *fn_data) {
+  if (ev == MG_EV_WRITE) mg_http_deadline(c, ev);
   if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
     FILE *fp = (FILE *) fn_data;
     // Read to send IO buffer directly, avoid extra on-stack buffer
@@ -716,6 +991,12 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data,
   (void) ev_data;
 }
 
+#if MG_ENABLE_SENDFILE
+static void fclose_cb(void *fp) {
+  fclose((FILE *) fp);
+}
+#endif
+
 static const char *guess_content_type(const char *filename) {
   size_t n = strlen(filename);
 #define MIME_ENTRY(_ext, _type) \
@@ -783,7 +1064,11 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
   struct mg_str *inm = mg_http_get_header(hm, "If-None-Match");
   mg_stat_t st;
   char etag[64];
-  FILE *fp = mg_fopen(path, "rb");
+  FILE *fp;
+#if MG_ENABLE_FILE_CACHE
+  if (mg_fcache_serve(c, hm, path, mime, hdrs)) return;
+#endif
+  fp = mg_fopen(path, "rb");
   if (fp == NULL || mg_stat(path, &st) != 0 ||
       mg_http_etag(etag, sizeof(etag), &st) != etag) {
     LOG(LL_DEBUG,
@@ -800,6 +1085,11 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
               mime, etag, (int64_t) st.st_size, hdrs ? hdrs : "");
     if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
       fclose(fp);
+#if MG_ENABLE_SENDFILE
+    } else if (mg_send_fd(c, fileno(fp), 0, (size_t) st.st_size, fclose_cb,
+                          fp)) {
+      // Zero-copy: sendfile() streams it whenever the socket is writable
+#endif
     } else {
       c->pfn = static_cb;
       c->pfn_data = fp;
@@ -1244,10 +1534,73 @@ void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm) {
   c->recv.len -= ch.len;
 }
 
+static int mg_http_phase_ms(struct mg_connection *c, int phase) {
+  struct mg_timeouts *t = &c->mgr->timeouts;
+  switch (phase) {
+    case MG_HTTP_PHASE_HEAD: return t->header_ms;
+    case MG_HTTP_PHASE_BODY: return t->body_ms;
+    case MG_HTTP_PHASE_WRITE: return t->write_ms;
+    default: return t->idle_ms;
+  }
+}
+
+static void mg_http_expire(void *arg) {
+  struct mg_connection *c = (struct mg_connection *) arg;
+  unsigned long now = c->mgr->now;
+  if (c->deadline == 0 || c->is_websocket || c->is_closing) return;
+  if ((long) (c->deadline - now) > 0) {
+    // The deadline moved on since the timer was armed
+    mg_timers_add(&c->mgr->timers, &c->timer, (int) (c->deadline - now), 0,
+                  mg_http_expire, c);
+  } else if (c->phase == MG_HTTP_PHASE_WRITE ||
+             c->phase == MG_HTTP_PHASE_IDLE || c->recv.len == 0) {
+    LOG(LL_DEBUG, ("%lu timed out in phase %d", c->id, c->phase));
+    c->is_closing = 1;
+  } else {
+    LOG(LL_DEBUG, ("%lu request timed out in phase %d", c->id, c->phase));
+    mg_http_reply(c, 408, "Connection: close\r\n", "Request Timeout\n");
+    c->is_draining = 1;
+    mg_http_deadline(c, MG_EV_WRITE);  // The 408 gets write_ms to go
+  }
+}
+
+// Work out the phase of an accepted connection and its deadline. Only a
+// new phase, or send progress, moves the deadline. The timer is re-armed
+// only when it would fire too late; when it fires too early, it re-arms
+// itself for the rest
+static void mg_http_deadline(struct mg_connection *c, int ev) {
+  bool progress = ev == MG_EV_WRITE;
+  int phase, ms;
+  if (!c->is_accepted || c->is_websocket || c->is_udp) return;
+  if (mg_send_pending(c)) {
+    phase = MG_HTTP_PHASE_WRITE;
+  } else if (ev == MG_EV_ACCEPT) {
+    phase = MG_HTTP_PHASE_HEAD;
+  } else if (c->recv.len == 0 || c->is_suspended) {
+    phase = MG_HTTP_PHASE_IDLE;
+  } else if (mg_http_get_request_len(c->recv.buf, c->recv.len) == 0) {
+    phase = MG_HTTP_PHASE_HEAD;
+  } else {
+    phase = MG_HTTP_PHASE_BODY;
+  }
+  if (phase == c->phase && !(progress && phase == MG_HTTP_PHASE_WRITE)) return;
+  c->phase = (unsigned char) phase;
+  ms = mg_http_phase_ms(c, phase);
+  c->deadline = ms > 0 ? c->mgr->now + (unsigned long) ms : 0;
+  if (ms > 0 && (c->timer.wheel == NULL ||
+                 (long) (c->timer.expire - c->deadline) > 0)) {
+    mg_timer_free(&c->timer);
+    mg_timers_add(&c->mgr->timers, &c->timer, ms, 0, mg_http_expire, c);
+  }
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
     struct mg_http_message hm;
     for (;;) {
+      // A handler that set is_suspended answers later, keep pipelined
+      // requests in c->recv until then so that responses stay in order
+      if (c->is_suspended) break;
       int n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
       bool is_chunked = n > 0 && mg_is_chunked(&hm);
       if (ev == MG_EV_CLOSE) {
@@ -1266,6 +1619,8 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
         mg_call(c, MG_EV_HTTP_MSG, &hm);
         mg_iobuf_delete(&c->recv, hm.message.len);
       } else {
+        // Let read_conn() size the receive buffer for the whole message
+        c->recv_hint = n > 0 && !is_chunked ? hm.message.len : 0;
         if (n > 0 && !is_chunked) {
           hm.chunk = mg_str_n((char *) &c->recv.buf[n], c->recv.len - n);
           mg_call(c, MG_EV_HTTP_CHUNK, &hm);
@@ -1274,10 +1629,23 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
       }
     }
   }
+  if (ev == MG_EV_ACCEPT || ev == MG_EV_READ || ev == MG_EV_WRITE) {
+    mg_http_deadline(c, ev);
+  }
   (void) fnd;
   (void) evd;
 }
 
+// Parse the requests that arrived while the connection was suspended
+void mg_http_resume(struct mg_connection *c) {
+  c->is_suspended = 0;
+  if (c->recv.len > 0 && !c->is_closing) {
+    http_cb(c, MG_EV_READ, NULL, NULL);
+  } else {
+    mg_http_deadline(c, MG_EV_READ);
+  }
+}
+
 struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
                                       mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = mg_connect(mgr, url, fn, fn_data);
@@ -1300,21 +1668,118 @@ struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
 
 #include <string.h>
 
+#if MG_ENABLE_BUFPOOL
+#if defined(__cplusplus)
+#define MG_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define MG_THREAD_LOCAL __declspec(thread)
+#else
+#define MG_THREAD_LOCAL __thread
+#endif
+
+// Free IO buffers of one thread, so no locking is needed. Each event loop
+// runs on its own thread and mostly frees what it has allocated. A buffer
+// is a plain malloc() block, the pool only keeps it around: the first word
+// of a free block links it to the next one of the same size class
+struct mg_bufpool {
+  void *free[MG_BUFPOOL_CLASSES];
+  unsigned count[MG_BUFPOOL_CLASSES];
+  unsigned long hits, misses;
+  size_t cached;
+};
+
+static MG_THREAD_LOCAL struct mg_bufpool s_bufpool;
+
+// Size class that fits `size` bytes, or -1 if it is too big to pool
+static int mg_bufpool_class(size_t size) {
+  size_t cap = MG_IO_SIZE;
+  int i = 0;
+  while (cap < size && i < MG_BUFPOOL_CLASSES) cap <<= 1, i++;
+  return i < MG_BUFPOOL_CLASSES ? i : -1;
+}
+
+static void *mg_buf_alloc(size_t size) {
+  struct mg_bufpool *bp = &s_bufpool;
+  int i = mg_bufpool_class(size);
+  void *p = NULL;
+  if (i < 0) {
+    p = malloc(size);
+  } else if ((p = bp->free[i]) != NULL) {
+    bp->free[i] = *(void **) p;
+    bp->count[i]--;
+    bp->cached -= (size_t) MG_IO_SIZE << i;
+    bp->hits++;
+  } else {
+    p = malloc((size_t) MG_IO_SIZE << i);  // Round up, so it can be reused
+    bp->misses++;
+  }
+  return p;
+}
+
+// `size` is what the block was allocated for, it determines the class
+static void mg_buf_free(void *p, size_t size) {
+  struct mg_bufpool *bp = &s_bufpool;
+  int i = mg_bufpool_class(size);
+  if (p == NULL) return;
+  if (i < 0 || bp->count[i] >= MG_BUFPOOL_DEPTH) {
+    free(p);
+  } else {
+    *(void **) p = bp->free[i];
+    bp->free[i] = p;
+    bp->count[i]++;
+    bp->cached += (size_t) MG_IO_SIZE << i;
+  }
+}
+
+// Give the calling thread's free buffers back to the system
+static void mg_bufpool_trim(void) {
+  struct mg_bufpool *bp = &s_bufpool;
+  int i;
+  for (i = 0; i < MG_BUFPOOL_CLASSES; i++) {
+    while (bp->free[i] != NULL) {
+      void *p = bp->free[i];
+      bp->free[i] = *(void **) p;
+      free(p);
+    }
+    bp->count[i] = 0;
+  }
+  bp->cached = 0;
+}
+#else
+#define mg_buf_alloc(size) malloc(size)
+#define mg_buf_free(p, size) free(p)
+#endif
+
+// Move data back to the start of the allocation, reclaiming the prefix
+static void mg_iobuf_compact(struct mg_iobuf *io) {
+  if (io->head > 0) {
+    unsigned char *base = io->buf - io->head;
+    memmove(base, io->buf, io->len);
+    io->buf = base;
+    io->size += io->head;
+    io->head = 0;
+  }
+}
+
 int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   int ok = 1;
   if (new_size == 0) {
-    free(io->buf);
+    mg_buf_free(io->buf - io->head, io->size + io->head);
     io->buf = NULL;
-    io->len = io->size = 0;
+    io->len = io->size = io->head = 0;
+  } else if (new_size > io->size && new_size <= io->size + io->head) {
+    mg_iobuf_compact(io);  // Enough room in front, no need to reallocate
   } else if (new_size != io->size) {
     // NOTE(lsm): do not use realloc here. Use malloc/free only, to ease the
     // porting to some obscure platforms like FreeRTOS
-    void *p = malloc(new_size);
+    void *p = mg_buf_alloc(new_size);
     if (p != NULL) {
-      memcpy(p, io->buf, io->size < new_size ? io->size : new_size);
-      free(io->buf);
+      if (io->len > new_size) io->len = new_size;
+      if (io->len > 0) memcpy(p, io->buf, io->len);
+      mg_buf_free(io->buf - io->head, io->size + io->head);
       io->buf = (unsigned char *) p;
       io->size = new_size;
+      io->head = 0;
     } else {
       ok = 0;
       LOG(LL_ERROR,
@@ -1330,10 +1795,15 @@ int mg_iobuf_init(struct mg_iobuf *io, size_t size) {
 
 size_t mg_iobuf_append(struct mg_iobuf *io, const void *buf, size_t len,
                        size_t chunk_size) {
-  size_t new_size = io->len + len + chunk_size;
-  new_size -= new_size % chunk_size;
-  if (new_size != io->size) mg_iobuf_resize(io, new_size);
-  if (new_size != io->size) len = 0;  // Realloc failure, append nothing
+  if (io->len + len > io->size) {
+    size_t total = io->size + io->head;
+    size_t new_size = io->len + len + chunk_size;
+    new_size -= new_size % chunk_size;
+    // Grow at least twofold, so that many small appends stay linear
+    if (new_size > total && new_size < 2 * total) new_size = 2 * total;
+    mg_iobuf_resize(io, new_size);
+  }
+  if (io->len + len > io->size) len = 0;  // Realloc failure, append nothing
   if (buf != NULL) memmove(io->buf + io->len, buf, len);
   io->len += len;
   return len;
@@ -1341,8 +1811,12 @@ size_t mg_iobuf_append(struct mg_iobuf *io, const void *buf, size_t len,
 
 size_t mg_iobuf_delete(struct mg_iobuf *io, size_t len) {
   if (len > io->len) len = 0;
-  memmove(io->buf, io->buf + len, io->len - len);
   io->len -= len;
+  if (io->len == 0) {
+    io->buf -= io->head, io->size += io->head, io->head = 0;  // Rewind
+  } else {
+    io->buf += len, io->size -= len, io->head += len;
+  }
   return len;
 }
 
@@ -1620,7 +2094,10 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   LOG(LL_DEBUG, ("%p %d", mgr, ms));
   mg_usleep(200 * 1000);
-  mg_timer_poll(mg_millis());
+  mgr->now = mg_millis();
+  mg_timer_poll(mgr->now);
+  mg_timers_poll(&mgr->timers, mgr->now);
+  mg_completions_run(mgr);
 }
 #endif
 
@@ -2110,6 +2587,26 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
 #line 1 "src/net.c"
 #endif
 
+#if MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#if MG_ENABLE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+#if MG_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+static void *mg_uring_init(void);
+static void mg_uring_free(void *);
+#endif
 
 
 
@@ -2222,12 +2719,262 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
   return mg_atonl(str, addr) || mg_aton4(str, addr) || mg_aton6(str, addr);
 }
 
+static void mg_idmap_grow(struct mg_mgr *mgr) {
+  size_t i, size = mgr->idmap_size == 0 ? 64 : mgr->idmap_size * 2;
+  struct mg_connection **map =
+      (struct mg_connection **) calloc(size, sizeof(*map));
+  if (map == NULL) {
+    LOG(LL_ERROR, ("OOM growing idmap to %lu", (unsigned long) size));
+    return;
+  }
+  for (i = 0; i < mgr->idmap_size; i++) {
+    struct mg_connection *c, *next;
+    for (c = mgr->idmap[i]; c != NULL; c = next) {
+      next = c->id_next;
+      c->id_next = map[c->id & (size - 1)];
+      map[c->id & (size - 1)] = c;
+    }
+  }
+  free(mgr->idmap);
+  mgr->idmap = map;
+  mgr->idmap_size = size;
+}
+
+static void mg_idmap_add(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  if (mgr->idmap_count >= mgr->idmap_size) mg_idmap_grow(mgr);
+  if (mgr->idmap_size > 0) {
+    struct mg_connection **head = &mgr->idmap[c->id & (mgr->idmap_size - 1)];
+    c->id_next = *head;
+    *head = c;
+    mgr->idmap_count++;
+  }
+}
+
+static void mg_idmap_del(struct mg_connection *c) {
+  struct mg_mgr *mgr = c->mgr;
+  if (mgr->idmap_size > 0) {
+    struct mg_connection **h = &mgr->idmap[c->id & (mgr->idmap_size - 1)];
+    while (*h != NULL && *h != c) h = &(*h)->id_next;
+    if (*h != NULL) *h = c->id_next, mgr->idmap_count--;
+  }
+}
+
+// IDs are never reused, so a stale ID held by a completion or a worker
+// thread safely resolves to NULL once the connection has been closed
+struct mg_connection *mg_conn_by_id(struct mg_mgr *mgr, unsigned long id) {
+  struct mg_connection *c = NULL;
+  if (mgr->idmap_size > 0) {
+    c = mgr->idmap[id & (mgr->idmap_size - 1)];
+    while (c != NULL && c->id != id) c = c->id_next;
+  }
+  return c;
+}
+
+// The completion queue is a lock-free stack. Any thread pushes with a CAS
+// on the head, the event loop takes the whole stack with one exchange. seen
+// is the head the push expects, and receives the actual head if it fails
+static bool mg_cq_push(struct mg_completion **head, struct mg_completion *cp,
+                       struct mg_completion **seen) {
+  cp->next = *seen;
+#if defined(_MSC_VER)
+  {
+    void *old = InterlockedCompareExchangePointer((PVOID volatile *) head, cp,
+                                                  *seen);
+    if (old == *seen) return true;
+    *seen = (struct mg_completion *) old;
+    return false;
+  }
+#else
+  return __atomic_compare_exchange_n(head, seen, cp, true, __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED);
+#endif
+}
+
+static struct mg_completion *mg_cq_take(struct mg_completion **head) {
+#if defined(_MSC_VER)
+  return (struct mg_completion *) InterlockedExchangePointer(
+      (PVOID volatile *) head, NULL);
+#else
+  return __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Thread-safe. Only the push that finds the queue empty wakes the loop up,
+// the ones that follow before it drains ride along. cp belongs to the event
+// loop as soon as it is pushed, so it is not read again after that
+void mg_complete(struct mg_mgr *mgr, struct mg_completion *cp) {
+  struct mg_completion *seen = NULL;
+  while (!mg_cq_push(&mgr->completions, cp, &seen)) (void) 0;
+#if MG_ENABLE_EVENTFD
+  if (seen == NULL && mgr->wakefd >= 0) {
+    uint64_t one = 1;
+    if (write(mgr->wakefd, &one, sizeof(one)) < 0) (void) 0;  // Full is fine
+  }
+#endif
+}
+
+// Run what mg_complete() has queued, oldest first
+void mg_completions_run(struct mg_mgr *mgr) {
+  struct mg_completion *cp = mg_cq_take(&mgr->completions), *fifo = NULL;
+  struct mg_completion *next;
+  for (; cp != NULL; cp = next) {
+    next = cp->next;
+    cp->next = fifo;
+    fifo = cp;
+  }
+  for (cp = fifo; cp != NULL; cp = next) {
+    struct mg_connection *c = mg_conn_by_id(mgr, cp->conn_id);
+    next = cp->next;
+    cp->fn(c != NULL && !c->is_closing ? c : NULL, cp);
+  }
+}
+
+#if MG_ENABLE_EVENTFD
+static void wake_cb(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  if (ev == MG_EV_READ) {
+    mg_iobuf_delete(&c->recv, c->recv.len);  // Just the eventfd counter
+    mg_completions_run(c->mgr);
+  } else if (ev == MG_EV_CLOSE) {
+    c->mgr->wakefd = -1;
+  }
+  (void) ev_data, (void) fn_data;
+}
+
+static void mg_wakeup_init(struct mg_mgr *mgr) {
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    LOG(LL_ERROR, ("eventfd: %d", errno));
+  } else if (mg_watch_fd(mgr, fd, wake_cb, NULL) == NULL) {
+    close(fd);
+  } else {
+    mgr->wakefd = fd;
+  }
+}
+#endif
+
+// Anything left to send, either copied into c->send or queued by reference
+bool mg_send_pending(struct mg_connection *c) {
+  return c->send.len > 0 || c->sendq != NULL;
+}
+
+// Drop the head of the by-reference queue and hand its data back
+static void mg_sendq_pop(struct mg_connection *c) {
+  struct mg_sendref *r = c->sendq;
+  c->sendq = r->next;
+  if (c->sendq == NULL) c->sendq_last = NULL, c->sendq_mark = 0;
+  if (r->release != NULL) r->release(r->release_arg);
+  free(r);
+}
+
+// Append an entry to the queue, after everything in c->send so far
+static void mg_sendq_add(struct mg_connection *c, struct mg_sendref *r,
+                         void (*release)(void *), void *release_arg) {
+  r->at = c->send.len - c->sendq_mark;
+  r->release = release;
+  r->release_arg = release_arg;
+  c->sendq_mark = c->send.len;
+  if (c->sendq_last != NULL) {
+    c->sendq_last->next = r;
+  } else {
+    c->sendq = r;
+  }
+  c->sendq_last = r;
+}
+
+// Like mg_send(), but without copying: `buf` must stay valid until
+// release(release_arg) is called, once the data is sent or the connection
+// is closed. Where data cannot go by reference (TLS, UDP, hexdump, small
+// chunks that are cheaper to copy), it is copied and released at once
+int mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                void (*release)(void *), void *release_arg) {
+  struct mg_sendref *r = NULL;
+  int n = (int) len;
+#if MG_ENABLE_SENDQ
+  if (len >= MG_IO_SIZE && !c->is_udp && !c->is_tls && !c->is_hexdumping) {
+    r = (struct mg_sendref *) calloc(1, sizeof(*r));
+  }
+#endif
+  if (r == NULL) {
+    n = mg_send(c, buf, len);
+    if (release != NULL) release(release_arg);
+  } else {
+    r->ptr = (const char *) buf;
+    r->fd = -1;
+    r->len = len;
+    mg_sendq_add(c, r, release, release_arg);
+  }
+  return n;
+}
+
+// Queue `len` bytes of file `fd`, starting at `offset`, to be streamed with
+// sendfile() as the socket drains. The file must stay open until release()
+// is called. Returns false if the connection cannot do that (TLS, UDP,
+// hexdump, no sendfile()); the caller then still owns the file
+bool mg_send_fd(struct mg_connection *c, int fd, size_t offset, size_t len,
+                void (*release)(void *), void *release_arg) {
+  struct mg_sendref *r = NULL;
+#if MG_ENABLE_SENDFILE
+  if (!c->is_udp && !c->is_tls && !c->is_hexdumping) {
+    r = (struct mg_sendref *) calloc(1, sizeof(*r));
+  }
+#endif
+  if (r != NULL && len == 0) {
+    free(r);
+    if (release != NULL) release(release_arg);
+  } else if (r != NULL) {
+    r->fd = fd;
+    r->offset = offset;
+    r->len = len;
+    mg_sendq_add(c, r, release, release_arg);
+  }
+  (void) fd, (void) offset;
+  return r != NULL;
+}
+
+// Buffer counters are those of the calling thread's pool. Called from an
+// event handler, that is the pool of the thread running this manager
+void mg_mgr_stats(struct mg_mgr *mgr, struct mg_alloc_stats *st) {
+  memset(st, 0, sizeof(*st));
+  st->conn_hits = mgr->conn_hits;
+  st->conn_misses = mgr->conn_misses;
+#if MG_ENABLE_BUFPOOL
+  st->buf_hits = s_bufpool.hits;
+  st->buf_misses = s_bufpool.misses;
+  st->buf_cached = s_bufpool.cached;
+#endif
+}
+
 void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_connection *c;
   for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
   mg_mgr_poll(mgr, 0);
+  mg_completions_run(mgr);  // Connections are gone, fn just cleans up
+  mg_timers_clear(&mgr->timers);
+  while ((c = mgr->spare) != NULL) {
+    mgr->spare = c->next;
+    free(c);
+  }
+  mgr->spare_count = 0;
+#if MG_ENABLE_BUFPOOL
+  mg_bufpool_trim();
+#endif
+  free(mgr->idmap);
+  mgr->idmap = NULL;
+  mgr->idmap_size = mgr->idmap_count = 0;
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_DeleteSocketSet(mgr->ss);
+#endif
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd);
+#endif
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) mg_uring_free(mgr->uring);
+  mgr->uring = NULL;
+#endif
+#if MG_ENABLE_FILE_CACHE
+  mg_fcache_free(mgr);
 #endif
   LOG(LL_INFO, ("All connections closed"));
 }
@@ -2245,8 +2992,36 @@ void mg_mgr_init(struct mg_mgr *mgr) {
 #endif
   memset(mgr, 0, sizeof(*mgr));
   mgr->dnstimeout = 3000;
+  mgr->backlog = MG_LISTEN_BACKLOG;
+  mgr->accept_budget = MG_ACCEPT_BUDGET;
+  mgr->sockopts.nodelay = true;
+  mgr->sockopts.quickack = true;
+  mgr->sockopts.keepidle = 60;
+  mgr->sockopts.keepintvl = 20;
+  mgr->sockopts.keepcnt = 3;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
+  mgr->now = mg_millis();
+  mg_timers_init(&mgr->timers, mgr->now);
+#if MG_ENABLE_IO_URING
+  mgr->uring = mg_uring_init();
+#endif
+#if MG_ENABLE_EPOLL
+  mgr->epoll_fd = -1;
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) {
+    // The ring takes over, no epoll needed
+  } else
+#endif
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    // mg_iotest() falls back to select(), with its FD_SETSIZE limit
+    LOG(LL_ERROR, ("epoll_create1: %d, using select()", errno));
+  }
+#endif
+  mgr->wakefd = -1;
+#if MG_ENABLE_EVENTFD
+  mg_wakeup_init(mgr);
+#endif
 }
 
 #ifdef MG_ENABLE_LINES
@@ -2621,6 +3396,10 @@ typedef int SOCKET;
 #define MSG_NONBLOCKING 0
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 union usa {
   struct sockaddr sa;
   struct sockaddr_in sin;
@@ -2659,12 +3438,21 @@ static int mg_sock_failed(void) {
 
 static struct mg_connection *alloc_conn(struct mg_mgr *mgr, int is_client,
                                         SOCKET fd) {
-  struct mg_connection *c = (struct mg_connection *) calloc(1, sizeof(*c));
+  struct mg_connection *c = mgr->spare;
+  if (c != NULL) {
+    mgr->spare = c->next;
+    mgr->spare_count--;
+    mgr->conn_hits++;
+    c->next = NULL;  // The rest was zeroed by close_conn()
+  } else if ((c = (struct mg_connection *) calloc(1, sizeof(*c))) != NULL) {
+    mgr->conn_misses++;
+  }
   if (c != NULL) {
     c->is_client = is_client;
     c->fd = (void *) (long) fd;
     c->mgr = mgr;
     c->id = ++mgr->nextid;
+    mg_idmap_add(c);
   }
   return c;
 }
@@ -2690,6 +3478,10 @@ static int mg_sock_recv(struct mg_connection *c, void *buf, int len,
         c->peer.port = usa.sin.sin_port;
       }
     }
+#if MG_ARCH == MG_ARCH_UNIX
+  } else if (c->is_raw_fd) {
+    n = (int) read(FD(c), buf, len);
+#endif
   } else {
     n = recv(FD(c), (char *) buf, len, MSG_NONBLOCKING);
   }
@@ -2766,7 +3558,36 @@ static void mg_set_non_blocking_mode(SOCKET fd) {
 #endif
 }
 
-SOCKET mg_open_listener(const char *url) {
+#if MG_ENABLE_EPOLL
+static void mg_epoll_ctl(struct mg_connection *c, int op, bool want_write) {
+  struct epoll_event ev;
+  if (c->mgr->epoll_fd < 0) return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, op, FD(c), &ev) != 0) {
+    LOG(LL_ERROR, ("%lu epoll_ctl(%d): %d", c->id, op, MG_SOCK_ERRNO));
+  } else {
+    c->is_epoll_out = want_write;
+  }
+}
+
+// Register a new socket in the interest set. Closing the socket removes it
+static void mg_epoll_add(struct mg_connection *c) {
+  mg_epoll_ctl(c, EPOLL_CTL_ADD, c->is_connecting);
+}
+
+// Touch the interest set only when the write interest has actually changed
+static void mg_epoll_sync(struct mg_connection *c) {
+  bool want_write =
+      c->is_connecting || (mg_send_pending(c) && c->is_tls_hs == 0);
+  if (want_write != (bool) c->is_epoll_out) {
+    mg_epoll_ctl(c, EPOLL_CTL_MOD, want_write);
+  }
+}
+#endif
+
+SOCKET mg_open_listener(struct mg_mgr *mgr, const char *url) {
   struct mg_addr addr;
   SOCKET fd = INVALID_SOCKET;
 
@@ -2801,10 +3622,18 @@ SOCKET mg_open_listener(const char *url) {
         //! &&
         !setsockopt(fd, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *) &on,
                     sizeof(on)) &&
+#endif
+#if defined(SO_REUSEPORT)
+        // Lets several managers, one per thread, listen on the same address.
+        // The kernel then load-balances incoming connections between them
+        (!mgr->reuseport ||
+         !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on))) &&
 #endif
         bind(fd, &usa.sa, slen) == 0 &&
         // NOTE(lsm): FreeRTOS uses backlog value as a connection limit
-        (type == SOCK_DGRAM || listen(fd, 128) == 0)) {
+        (type == SOCK_DGRAM ||
+         listen(fd, mgr->backlog > 0 ? mgr->backlog : MG_LISTEN_BACKLOG) ==
+             0)) {
       mg_set_non_blocking_mode(fd);
     } else if (fd != INVALID_SOCKET) {
       LOG(LL_ERROR, ("Failed to listen on %s, errno %d", url, MG_SOCK_ERRNO));
@@ -2816,35 +3645,383 @@ SOCKET mg_open_listener(const char *url) {
   return fd;
 }
 
-static void read_conn(struct mg_connection *c,
-                      int (*fn)(struct mg_connection *, void *, int, int *)) {
-  unsigned char *buf;
-  int rc, len, fail;
-
-  // NOTE(lsm): do only one iteration of reads, cause some systems
-  // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
-  if (c->recv.size - c->recv.len < MG_IO_SIZE &&
-      c->recv.size < MG_MAX_RECV_BUF_SIZE &&
-      !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
-    c->is_closing = 1;
+#if MG_ENABLE_IO_URING
+// io_uring engine. TCP listeners use multishot accept. Accepted plain TCP
+// connections use multishot recv into a kernel-provided buffer ring, and
+// their pending output is flushed with one batch of non-blocking sends per
+// mg_mgr_poll() iteration. Everything else (UDP, outbound connections, TLS)
+// gets one-shot POLL_ADD readiness and goes through read_conn()/write_conn()
+enum {
+  MG_URING_ACCEPT = 1,
+  MG_URING_RECV,
+  MG_URING_SEND,
+  MG_URING_POLL_IN,
+  MG_URING_POLL_OUT,
+  MG_URING_CANCEL
+};
+#define MG_URING_BGID 0  // Buffer group ID of the provided buffer ring
+
+struct mg_uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, sq_entries, sq_local_tail;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *rings;                   // Single mmap for both SQ and CQ rings
+  size_t rings_len, sqes_len;
+  struct io_uring_buf_ring *br;  // Provided buffer ring for multishot recv
+  unsigned char *bufs;           // MG_IO_URING_BUFS * MG_IO_URING_BUF_SIZE
+  uint16_t br_tail;
+};
+
+// Connection IDs are stored in user_data, never connection pointers: a
+// completion may arrive after the connection is freed
+#define MG_URING_UD(c_, op_) (((uint64_t) (c_)->id << 8) | (op_))
+
+// Accepted plain TCP connections take the multishot recv + batched send path
+static bool mg_uring_is_stream(const struct mg_connection *c) {
+  return c->is_accepted && !c->is_udp && !c->is_tls && !c->is_hexdumping;
+}
+
+static int mg_uring_enter(struct mg_uring *u, unsigned wait, int ms) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned flags = 0, submit =
+      u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+  memset(&arg, 0, sizeof(arg));
+  if (wait > 0) {
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long long) (ms % 1000) * 1000000;
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  }
+  return (int) syscall(__NR_io_uring_enter, u->fd, submit, wait, flags,
+                       wait > 0 ? &arg : NULL, sizeof(arg));
+}
+
+static struct io_uring_sqe *mg_uring_sqe(struct mg_uring *u) {
+  struct io_uring_sqe *sqe = NULL;
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (u->sq_local_tail - head >= u->sq_entries) {
+    mg_uring_enter(u, 0, 0);  // Queue is full, hand it over to the kernel
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  }
+  if (u->sq_local_tail - head < u->sq_entries) {
+    sqe = &u->sqes[u->sq_local_tail++ & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+  } else {
+    LOG(LL_ERROR, ("io_uring submission queue overflow"));
   }
-  buf = c->recv.buf + c->recv.len;
-  len = (int) (c->recv.size - c->recv.len);
-  rc = fn(c, buf, len, &fail);
-  if (rc > 0) {
-    struct mg_str evd = mg_str_n((char *) buf, rc);
-    c->recv.len += rc;
-    mg_call(c, MG_EV_READ, &evd);
+  return sqe;
+}
+
+static struct io_uring_sqe *mg_uring_op(struct mg_uring *u,
+                                        struct mg_connection *c, int opcode,
+                                        int tag) {
+  struct io_uring_sqe *sqe = mg_uring_sqe(u);
+  if (sqe != NULL) {
+    sqe->opcode = (uint8_t) opcode;
+    sqe->fd = FD(c);
+    sqe->user_data = MG_URING_UD(c, tag);
+  }
+  return sqe;
+}
+
+static void mg_uring_poll(struct mg_uring *u, struct mg_connection *c,
+                          unsigned events, int tag) {
+  struct io_uring_sqe *sqe = mg_uring_op(u, c, IORING_OP_POLL_ADD, tag);
+  if (sqe == NULL) return;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  events = (events << 16) | (events >> 16);  // poll32_events is word-swapped
+#endif
+  sqe->poll32_events = events;
+  if (tag == MG_URING_POLL_OUT) {
+    c->is_uring_out = 1;
   } else {
-    if (fail) c->is_closing = 1;
+    c->is_uring_armed = 1;
+  }
+}
+
+// Return a consumed receive buffer back to the kernel. NOTE: don't index
+// u->br->bufs, in C++ the flexible array member lands at the wrong offset
+static void mg_uring_buf_put(struct mg_uring *u, uint16_t bid) {
+  struct io_uring_buf *b =
+      (struct io_uring_buf *) u->br + (u->br_tail & (MG_IO_URING_BUFS - 1));
+  b->addr = (uint64_t) (uintptr_t) (u->bufs + (size_t) bid * MG_IO_URING_BUF_SIZE);
+  b->len = MG_IO_URING_BUF_SIZE;
+  b->bid = bid;
+  __atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+// Requests hold a reference to the socket, so closing the descriptor alone
+// would not stop them. Cancel them by user_data, which unlike the descriptor
+// number cannot be reused by a new connection before the cancel is processed
+static void mg_uring_cancel(struct mg_connection *c) {
+  struct mg_uring *u = (struct mg_uring *) c->mgr->uring;
+  int tags[2] = {0, 0}, i;
+  if (c->is_uring_armed) {
+    tags[0] = c->is_listening && !c->is_udp ? MG_URING_ACCEPT
+              : mg_uring_is_stream(c)        ? MG_URING_RECV
+                                             : MG_URING_POLL_IN;
+  }
+  if (c->is_uring_out) tags[1] = MG_URING_POLL_OUT;
+  for (i = 0; i < 2; i++) {
+    struct io_uring_sqe *sqe;
+    if (tags[i] == 0 || (sqe = mg_uring_sqe(u)) == NULL) continue;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MG_URING_UD(c, tags[i]);
+    sqe->user_data = MG_URING_CANCEL;
+  }
+  c->is_uring_armed = c->is_uring_out = 0;
+}
+
+static void mg_uring_free(void *p) {
+  struct mg_uring *u = (struct mg_uring *) p;
+  if (u->br != NULL) munmap(u->br, MG_IO_URING_BUFS * sizeof(struct io_uring_buf));
+  if (u->sqes != NULL) munmap(u->sqes, u->sqes_len);
+  if (u->rings != NULL) munmap(u->rings, u->rings_len);
+  if (u->fd >= 0) close(u->fd);
+  free(u->bufs);
+  free(u);
+}
+
+static void *mg_uring_init(void) {
+  struct mg_uring *u = (struct mg_uring *) calloc(1, sizeof(*u));
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t sq_len, cq_len;
+  unsigned i;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = MG_IO_URING_ENTRIES * 4;
+  if (u == NULL) return NULL;
+  u->fd = (int) syscall(__NR_io_uring_setup, MG_IO_URING_ENTRIES, &p);
+  if (u->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    LOG(LL_ERROR, ("io_uring unavailable (%d), falling back", errno));
+    goto fail;
   }
+
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->rings_len = sq_len > cq_len ? sq_len : cq_len;
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->rings = mmap(NULL, u->rings_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_len,
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->fd,
+                                         IORING_OFF_SQES);
+  if (u->rings == MAP_FAILED || u->sqes == MAP_FAILED) {
+    if (u->rings == MAP_FAILED) u->rings = NULL;
+    if (u->sqes == MAP_FAILED) u->sqes = NULL;
+    LOG(LL_ERROR, ("io_uring mmap: %d", errno));
+    goto fail;
+  }
+  {
+    char *sq = (char *) u->rings;
+    unsigned *array = (unsigned *) (sq + p.sq_off.array);
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned *) (sq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (sq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (sq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (sq + p.cq_off.cqes);
+    for (i = 0; i < p.sq_entries; i++) array[i] = i;  // SQE i lives in slot i
+  }
+
+  // Provided buffer ring, the kernel picks a buffer when data arrives
+  u->bufs = (unsigned char *) malloc((size_t) MG_IO_URING_BUFS *
+                                     MG_IO_URING_BUF_SIZE);
+  u->br = (struct io_uring_buf_ring *) mmap(
+      NULL, MG_IO_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED) u->br = NULL;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+  reg.ring_entries = MG_IO_URING_BUFS;
+  reg.bgid = MG_URING_BGID;
+  if (u->bufs == NULL || u->br == NULL ||
+      syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) != 0) {
+    LOG(LL_ERROR, ("io_uring buffer ring: %d, falling back", errno));
+    goto fail;
+  }
+  for (i = 0; i < MG_IO_URING_BUFS; i++) mg_uring_buf_put(u, (uint16_t) i);
+
+  LOG(LL_INFO, ("io_uring ready, %u entries", p.sq_entries));
+  return u;
+
+fail:
+  mg_uring_free(u);
+  return NULL;
 }
+#endif
+
+// Make room for at least `room` more bytes in c->recv. The buffer doubles,
+// or jumps straight to c->recv_hint when the protocol handler knows how big
+// the current message is, so a large body is not received into a chain of
+// small reallocations. Returns false on allocation failure only: at
+// MG_MAX_RECV_BUF_SIZE there may be less room than asked for
+static bool mg_recv_reserve(struct mg_connection *c, size_t room) {
+  struct mg_iobuf *io = &c->recv;
+  size_t size = io->size > 0 ? io->size : MG_IO_SIZE;
+  if (io->size - io->len >= room) return true;
+  while (size < io->len + room) size *= 2;
+  if (size < c->recv_hint) size = c->recv_hint;
+  if (size > MG_MAX_RECV_BUF_SIZE) size = MG_MAX_RECV_BUF_SIZE;
+  return size <= io->size || mg_iobuf_resize(io, size);
+}
+
+static void read_conn(struct mg_connection *c,
+                      int (*fn)(struct mg_connection *, void *, int, int *)) {
+  size_t total = 0;
+  for (;;) {
+    unsigned char *buf;
+    int rc, len, fail;
+
+    if (!mg_recv_reserve(c, MG_IO_SIZE)) {
+      c->is_closing = 1;
+      break;
+    }
+    buf = c->recv.buf + c->recv.len;
+    len = (int) (c->recv.size - c->recv.len);
+    rc = fn(c, buf, len, &fail);
+    if (rc > 0) {
+      struct mg_str evd = mg_str_n((char *) buf, rc);
+      c->recv.len += rc;
+      total += rc;
+      mg_call(c, MG_EV_READ, &evd);
+    } else {
+      if (fail) c->is_closing = 1;
+      break;
+    }
+#if MG_ARCH == MG_ARCH_FREERTOS
+    // NOTE(lsm): do only one iteration of reads, cause some systems
+    // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
+    break;
+#endif
+    // Keep reading a stream until it would block. A short read means the
+    // socket is already drained, so skip the recv() that would say so.
+    // TLS returns one record at a time, short reads say nothing there
+    if (c->is_udp || c->is_closing || c->is_draining) break;
+    if (rc < len && !c->is_tls) break;
+    if (total >= MG_READ_BUDGET) break;
+  }
+}
+
+// Drop `n` sent bytes, taking them from c->send and sendq in queue order
+static void mg_send_consumed(struct mg_connection *c, size_t n) {
+  struct mg_sendref *r;
+  while (n > 0 && (r = c->sendq) != NULL) {
+    size_t k = n < r->at ? n : r->at;
+    mg_iobuf_delete(&c->send, k);
+    r->at -= k, c->sendq_mark -= k, n -= k;
+    k = n < r->len ? n : r->len;
+    if (r->fd < 0) r->ptr += k;
+    r->offset += k, r->len -= k, n -= k;
+    if (r->at == 0 && r->len == 0) mg_sendq_pop(c);
+  }
+  mg_iobuf_delete(&c->send, n);
+  if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
+}
+
+// Copy the queue into c->send, for transports that cannot gather (TLS)
+static void mg_sendq_flatten(struct mg_connection *c) {
+  struct mg_iobuf io = {NULL, 0, 0, 0};
+  size_t off = 0;
+  while (c->sendq != NULL) {
+    struct mg_sendref *r = c->sendq;
+    mg_iobuf_append(&io, c->send.buf + off, r->at, MG_IO_SIZE);
+    if (r->fd < 0) {
+      mg_iobuf_append(&io, r->ptr, r->len, MG_IO_SIZE);
+    } else {
+#if MG_ENABLE_SENDFILE
+      size_t n = io.len;
+      ssize_t got = 0;
+      if (mg_iobuf_append(&io, NULL, r->len, MG_IO_SIZE) == r->len) {
+        got = pread(r->fd, io.buf + n, r->len, (off_t) r->offset);
+      }
+      if (got != (ssize_t) r->len) c->is_closing = 1;  // Cannot send it all
+#endif
+    }
+    off += r->at;
+    mg_sendq_pop(c);
+  }
+  mg_iobuf_append(&io, c->send.buf + off, c->send.len - off, MG_IO_SIZE);
+  mg_iobuf_free(&c->send);
+  c->send = io;
+}
+
+#if MG_ENABLE_SENDQ
+// Send c->send and sendq in order with one gathering sendmsg()
+static int mg_sendq_write(struct mg_connection *c, int *fail) {
+  struct iovec iov[MG_SENDQ_IOV];
+  struct msghdr msg;
+  struct mg_sendref *r = c->sendq;
+  size_t off = 0;
+  int n = 0, rc;
+#if MG_ENABLE_SENDFILE
+  if (r->fd >= 0 && r->at == 0) {
+    off_t pos = (off_t) r->offset;
+    size_t len = r->len < MG_SENDFILE_CHUNK ? r->len : MG_SENDFILE_CHUNK;
+    rc = (int) sendfile(FD(c), r->fd, &pos, len);
+    // Zero means the file got shorter than promised, don't spin on it
+    *fail = rc == 0 || (rc < 0 && mg_sock_failed());
+    LOG(*fail ? LL_ERROR : LL_VERBOSE_DEBUG,
+        ("%lu sendfile %d %d", c->id, rc, MG_SOCK_ERRNO));
+    return rc;
+  }
+#endif
+  // Gather everything up to the first file entry
+  for (; r != NULL && n + 2 <= MG_SENDQ_IOV; r = r->next) {
+    if (r->at > 0) {
+      iov[n].iov_base = c->send.buf + off;
+      iov[n++].iov_len = r->at;
+      off += r->at;
+    }
+    if (r->fd >= 0) break;
+    iov[n].iov_base = (void *) r->ptr;
+    iov[n++].iov_len = r->len;
+  }
+  if (r == NULL && off < c->send.len && n < MG_SENDQ_IOV) {
+    iov[n].iov_base = c->send.buf + off;
+    iov[n++].iov_len = c->send.len - off;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  rc = (int) sendmsg(FD(c), &msg, MSG_NONBLOCKING | MSG_NOSIGNAL);
+  *fail = rc < 0 && mg_sock_failed();
+  LOG(*fail ? LL_ERROR : LL_VERBOSE_DEBUG,
+      ("%lu sendmsg %d iov %d %d", c->id, n, rc, MG_SOCK_ERRNO));
+  return rc;
+}
+#endif
 
 static int write_conn(struct mg_connection *c) {
-  int fail, rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+  int fail, rc;
+  if (c->sendq != NULL && (c->is_tls || c->is_hexdumping || c->is_udp)) {
+    mg_sendq_flatten(c);  // TLS got enabled after the data was queued
+  }
+#if MG_ENABLE_SENDQ
+  if (c->sendq != NULL) {
+    rc = mg_sendq_write(c, &fail);
+  } else
+#endif
+  {
+    rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+  }
   if (rc > 0) {
-    mg_iobuf_delete(&c->send, rc);
-    if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
+    mg_send_consumed(c, rc);
     mg_call(c, MG_EV_WRITE, &rc);
   } else if (fail) {
     c->is_closing = 1;
@@ -2855,7 +4032,12 @@ static int write_conn(struct mg_connection *c) {
 static void close_conn(struct mg_connection *c) {
   // Unlink this connection from the list
   LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
+  mg_idmap_del(c);
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL) mg_uring_cancel(c);
+#endif
   mg_resolve_cancel(c);
+  mg_timer_free(&c->timer);
   if (c == c->mgr->dns4.c) c->mgr->dns4.c = NULL;
   if (c == c->mgr->dns6.c) c->mgr->dns6.c = NULL;
   mg_call(c, MG_EV_CLOSE, NULL);
@@ -2868,37 +4050,81 @@ static void close_conn(struct mg_connection *c) {
 #endif
   }
   mg_tls_free(c);
-  free(c->recv.buf);
-  free(c->send.buf);
-  memset(c, 0, sizeof(*c));
-  free(c);
+  while (c->sendq != NULL) mg_sendq_pop(c);
+  mg_iobuf_free(&c->recv);
+  mg_iobuf_free(&c->send);
+  {
+    struct mg_mgr *mgr = c->mgr;
+    memset(c, 0, sizeof(*c));
+    if (mgr->spare_count < MG_CONN_FREELIST_MAX) {
+      c->next = mgr->spare;  // Keep it for alloc_conn()
+      mgr->spare = c;
+      mgr->spare_count++;
+    } else {
+      free(c);
+    }
+  }
 }
 
+// accept4() hands out sockets that are already non-blocking, and Linux clones
+// them from the listener, so they inherit the options set by mg_listen()
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+#define MG_ACCEPT4 1
+#else
+#define MG_ACCEPT4 0
+#endif
+
 static void setsockopts(struct mg_connection *c) {
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_FD_SET(c->fd, c->mgr->ss, eSELECT_READ | eSELECT_EXCEPT);
 #else
+  const struct mg_sockopts *o = &c->mgr->sockopts;
   int on = 1;
 #if !defined(SOL_TCP)
 #define SOL_TCP IPPROTO_TCP
 #endif
-  setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
 #if defined(TCP_QUICKACK)
-  setsockopt(FD(c), SOL_TCP, TCP_QUICKACK, (char *) &on, sizeof(on));
+  // Not inherited: the kernel may leave quick ACK mode at any time
+  if (o->quickack) {
+    setsockopt(FD(c), SOL_TCP, TCP_QUICKACK, (char *) &on, sizeof(on));
+  }
 #endif
-  setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
+  if (MG_ACCEPT4 && c->is_accepted) return;
+  if (o->nodelay) {
+    setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+  }
+  if (o->keepidle > 0) {
+    setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
 #if ESP32 || ESP8266 || defined(__linux__)
-  int idle = 60;
-  setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPIDLE, &o->keepidle,
+               sizeof(o->keepidle));
 #endif
 #if !defined(_WIN32) && !defined(__QNX__)
-  {
-    int cnt = 3, intvl = 20;
-    setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
-    setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPCNT, &o->keepcnt,
+               sizeof(o->keepcnt));
+    setsockopt(FD(c), IPPROTO_TCP, TCP_KEEPINTVL, &o->keepintvl,
+               sizeof(o->keepintvl));
+#endif
   }
 #endif
+}
+
+// select() can only watch descriptors below FD_SETSIZE. It is in use unless
+// the ring or epoll came up, which is only known once mg_mgr_init() ran
+static bool mg_fd_fits(struct mg_mgr *mgr, SOCKET fd) {
+  bool ok = true;
+#if !defined(_WIN32)
+  bool selecting = true;
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) selecting = false;
+#endif
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) selecting = false;
+#endif
+  if (selecting) ok = fd < FD_SETSIZE;
 #endif
+  (void) mgr, (void) fd;
+  return ok;
 }
 
 void mg_connect_resolved(struct mg_connection *c) {
@@ -2914,9 +4140,18 @@ void mg_connect_resolved(struct mg_connection *c) {
     mg_error(c, "socket(): %d", MG_SOCK_ERRNO);
     return;
   }
+  if (!mg_fd_fits(c->mgr, FD(c))) {
+    mg_error(c, "%ld > %ld", (long) FD(c), (long) FD_SETSIZE);
+    closesocket(FD(c));  // Out of the fd_set's reach, even while closing
+    c->fd = (void *) (long) INVALID_SOCKET;
+    return;
+  }
 
   mg_set_non_blocking_mode(FD(c));
   mg_call(c, MG_EV_RESOLVE, NULL);
+#if MG_ENABLE_EPOLL
+  mg_epoll_add(c);
+#endif
   if (type == SOCK_STREAM) {
     union usa usa = tousa(&c->peer);
     socklen_t slen =
@@ -2932,6 +4167,9 @@ void mg_connect_resolved(struct mg_connection *c) {
       setsockopts(c);
     }
     if (rc < 0) c->is_connecting = 1;
+#if MG_ENABLE_EPOLL
+    if (c->is_connecting) mg_epoll_sync(c);
+#endif
   }
 }
 
@@ -2953,38 +4191,38 @@ struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+// Wrap an accepted socket into a connection that inherits listener's handlers
+static void setup_accepted(struct mg_mgr *mgr, struct mg_connection *lsn,
+                           SOCKET fd, union usa *usa, socklen_t sa_len) {
   struct mg_connection *c = NULL;
-  union usa usa;
-  socklen_t sa_len = sizeof(usa);
-  SOCKET fd = accept(FD(lsn), &usa.sa, &sa_len);
-  if (fd == INVALID_SOCKET) {
-    LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
-#if !defined(_WIN32)
-  } else if (fd >= FD_SETSIZE) {
+  if (!mg_fd_fits(mgr, fd)) {
     LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
-#endif
   } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
     LOG(LL_ERROR, ("%lu OOM", lsn->id));
     closesocket(fd);
   } else {
     char buf[40];
-    c->peer.port = usa.sin.sin_port;
-    memcpy(&c->peer.ip, &usa.sin.sin_addr, sizeof(c->peer.ip));
+    c->peer.port = usa->sin.sin_port;
+    memcpy(&c->peer.ip, &usa->sin.sin_addr, sizeof(c->peer.ip));
 #if MG_ENABLE_IPV6
-    if (sa_len == sizeof(usa.sin6)) {
-      memcpy(c->peer.ip6, &usa.sin6.sin6_addr, sizeof(c->peer.ip6));
-      c->peer.port = usa.sin6.sin6_port;
+    if (sa_len == sizeof(usa->sin6)) {
+      memcpy(c->peer.ip6, &usa->sin6.sin6_addr, sizeof(c->peer.ip6));
+      c->peer.port = usa->sin6.sin6_port;
       c->peer.is_ip6 = 1;
     }
 #endif
     mg_straddr(c, buf, sizeof(buf));
     LOG(LL_DEBUG, ("%lu accepted %s", c->id, buf));
+    c->is_accepted = 1;
+#if !MG_ACCEPT4
     mg_set_non_blocking_mode(FD(c));
+#endif
     setsockopts(c);
+#if MG_ENABLE_EPOLL
+    mg_epoll_add(c);
+#endif
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
-    c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
     c->pfn = lsn->pfn;
     c->pfn_data = lsn->pfn_data;
@@ -2992,6 +4230,30 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     c->fn_data = lsn->fn_data;
     mg_call(c, MG_EV_ACCEPT, NULL);
   }
+  (void) sa_len;
+}
+
+// Drain the listener's queue until it is empty or the budget is spent.
+// Whatever is left keeps the listener readable for the next poll
+static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+  int i, budget = mgr->accept_budget > 0 ? mgr->accept_budget : 1;
+  for (i = 0; i < budget; i++) {
+    union usa usa;
+    socklen_t sa_len = sizeof(usa);
+#if MG_ACCEPT4
+    SOCKET fd =
+        accept4(FD(lsn), &usa.sa, &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    SOCKET fd = accept(FD(lsn), &usa.sa, &sa_len);
+#endif
+    if (fd == INVALID_SOCKET) {
+      if (mg_sock_failed()) {
+        LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
+      }
+      break;
+    }
+    setup_accepted(mgr, lsn, fd, &usa, sa_len);
+  }
 }
 
 #if MG_ENABLE_SOCKETPAIR
@@ -3040,8 +4302,11 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
                                 mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   int is_udp = strncmp(url, "udp:", 4) == 0;
-  SOCKET fd = mg_open_listener(url);
+  SOCKET fd = mg_open_listener(mgr, url);
   if (fd == INVALID_SOCKET) {
+  } else if (!mg_fd_fits(mgr, fd)) {
+    LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
+    closesocket(fd);
   } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
     LOG(LL_ERROR, ("OOM %s", url));
     closesocket(fd);
@@ -3050,6 +4315,9 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     c->is_listening = 1;
     c->is_udp = is_udp;
     setsockopts(c);
+#if MG_ENABLE_EPOLL
+    mg_epoll_add(c);
+#endif
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fn = fn;
     c->fn_data = fn_data;
@@ -3058,21 +4326,181 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
-static void mg_iotest(struct mg_mgr *mgr, int ms) {
-#if MG_ARCH == MG_ARCH_FREERTOS
+#if MG_ARCH == MG_ARCH_UNIX
+// Watch a descriptor that is not a socket, e.g. from inotify or eventfd.
+// Data read from it arrives with MG_EV_READ, like on any connection, and it
+// is closed with the connection. On failure, the caller still owns `fd`
+struct mg_connection *mg_watch_fd(struct mg_mgr *mgr, int fd,
+                                  mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c = NULL;
+  if (!mg_fd_fits(mgr, fd)) {
+    LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
+  } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
+    LOG(LL_ERROR, ("OOM"));
+  } else {
+    c->is_raw_fd = 1;
+    mg_set_non_blocking_mode(fd);
+#if MG_ENABLE_EPOLL
+    mg_epoll_add(c);
+#endif
+    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    c->fn = fn;
+    c->fn_data = fn_data;
+  }
+  return c;
+}
+#endif
+
+#if MG_ENABLE_IO_URING
+static void mg_uring_read(struct mg_connection *c, const void *buf, int n) {
+  size_t need = c->recv.len + n;
+  struct mg_str evd;
+  if (need > MG_MAX_RECV_BUF_SIZE) {
+    mg_error(c, "max recv buffer %lu exceeded", (unsigned long) need);
+  } else if (!mg_recv_reserve(c, n)) {
+    c->is_closing = 1;
+  } else {
+    memcpy(c->recv.buf + c->recv.len, buf, n);
+    evd = mg_str_n((char *) c->recv.buf + c->recv.len, n);
+    c->recv.len += n;
+    mg_call(c, MG_EV_READ, &evd);
+  }
+}
+
+static void mg_uring_complete(struct mg_mgr *mgr, struct mg_uring *u,
+                              uint64_t ud, int res, unsigned flags) {
+  struct mg_connection *c = mg_conn_by_id(mgr, (unsigned long) (ud >> 8));
+  bool more = flags & IORING_CQE_F_MORE;
+  switch ((int) (ud & 255)) {
+    case MG_URING_ACCEPT:
+      if (res >= 0 && c == NULL) {
+        close(res);  // Listener is gone
+      } else if (res >= 0) {
+        union usa usa;
+        socklen_t sa_len = sizeof(usa);
+        memset(&usa, 0, sizeof(usa));
+        getpeername(res, &usa.sa, &sa_len);
+        setup_accepted(mgr, c, res, &usa, sa_len);
+      } else if (res != -ECANCELED) {
+        LOG(LL_ERROR, ("%lu accept failed, errno %d", c->id, -res));
+      }
+      if (c != NULL && !more) c->is_uring_armed = 0;
+      break;
+    case MG_URING_RECV:
+      if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+        if (c != NULL && res > 0) {
+          mg_uring_read(c, u->bufs + (size_t) bid * MG_IO_URING_BUF_SIZE, res);
+        }
+        mg_uring_buf_put(u, bid);
+      }
+      if (c == NULL) break;
+      if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        LOG(LL_DEBUG, ("%lu recv %d", c->id, res));
+        c->is_closing = 1;
+      }
+      if (!more) c->is_uring_armed = 0;  // Re-armed on the next iteration
+      break;
+    case MG_URING_SEND:
+      if (c == NULL) break;
+      c->is_uring_sending = 0;
+      if (res > 0) {
+        mg_send_consumed(c, res);
+        mg_call(c, MG_EV_WRITE, &res);
+      } else if (res == -EAGAIN) {
+        mg_uring_poll(u, c, POLLOUT, MG_URING_POLL_OUT);
+      } else {
+        LOG(LL_DEBUG, ("%lu send %d", c->id, res));
+        c->is_closing = 1;
+      }
+      break;
+    case MG_URING_POLL_IN:
+      if (c == NULL) break;
+      c->is_uring_armed = 0;
+      if (res != -ECANCELED) c->is_readable = 1;
+      break;
+    case MG_URING_POLL_OUT:
+      if (c == NULL) break;
+      c->is_uring_out = 0;
+      if (res != -ECANCELED) c->is_writable = 1;
+      break;
+    default:
+      break;
+  }
+}
+
+static void mg_uring_iotest(struct mg_mgr *mgr, int ms) {
+  struct mg_uring *u = (struct mg_uring *) mgr->uring;
   struct mg_connection *c;
+  struct io_uring_sqe *sqe;
+  unsigned head, tail;
+
   for (c = mgr->conns; c != NULL; c = c->next) {
-    FreeRTOS_FD_CLR(c->fd, mgr->ss, eSELECT_WRITE);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
-      FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_WRITE);
+    // TLS might have stuff buffered, so dig everything
+    c->is_readable = c->is_tls && c->is_readable ? 1 : 0;
+    c->is_writable = 0;
+    if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
+    if (c->is_listening && !c->is_udp) {
+      if (!c->is_uring_armed &&
+          (sqe = mg_uring_op(u, c, IORING_OP_ACCEPT, MG_URING_ACCEPT))) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        c->is_uring_armed = 1;
+      }
+    } else if (mg_uring_is_stream(c)) {
+      if (!c->is_uring_armed &&
+          (sqe = mg_uring_op(u, c, IORING_OP_RECV, MG_URING_RECV))) {
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = MG_URING_BGID;
+        c->is_uring_armed = 1;
+      }
+      // MSG_DONTWAIT makes the send complete during io_uring_enter(), so
+      // c->send is consumed before any handler gets a chance to touch it.
+      // Data queued by reference is gathered by write_conn() instead, once
+      // POLLOUT says there is room
+      if (c->sendq != NULL) {
+        if (!c->is_uring_out && !c->is_uring_sending) {
+          mg_uring_poll(u, c, POLLOUT, MG_URING_POLL_OUT);
+        }
+      } else if (c->send.len > 0 && !c->is_uring_out &&
+                 !c->is_uring_sending &&
+                 (sqe = mg_uring_op(u, c, IORING_OP_SEND, MG_URING_SEND))) {
+        sqe->addr = (uint64_t) (uintptr_t) c->send.buf;
+        sqe->len = (uint32_t) c->send.len;
+        sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+        c->is_uring_sending = 1;
+      }
+    } else {
+      if (!c->is_uring_armed) mg_uring_poll(u, c, POLLIN, MG_URING_POLL_IN);
+      if ((c->is_connecting || (mg_send_pending(c) && c->is_tls_hs == 0)) &&
+          !c->is_uring_out) {
+        mg_uring_poll(u, c, POLLOUT, MG_URING_POLL_OUT);
+      }
+    }
   }
-  FreeRTOS_select(mgr->ss, pdMS_TO_TICKS(ms));
-  for (c = mgr->conns; c != NULL; c = c->next) {
-    EventBits_t bits = FreeRTOS_FD_ISSET(c->fd, mgr->ss);
-    c->is_readable = bits & (eSELECT_READ | eSELECT_EXCEPT) ? 1 : 0;
-    c->is_writable = bits & eSELECT_WRITE ? 1 : 0;
+
+  // One syscall submits everything queued above and waits for completions
+  if (mg_uring_enter(u, 1, ms) < 0 && errno != ETIME && errno != EINTR) {
+    LOG(LL_DEBUG, ("io_uring_enter: %d", errno));
   }
-#else
+  // Completions below call handlers, which must see the time after the wait
+  mgr->now = mg_millis();
+
+  head = *u->cq_head;
+  tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    mg_uring_complete(mgr, u, cqe->user_data, cqe->res, cqe->flags);
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+#if MG_ARCH != MG_ARCH_FREERTOS
+// Wait up to ms for socket events with select(). Also where epoll falls back
+// to if mg_mgr_init() could not create its instance
+static void mg_select_iotest(struct mg_mgr *mgr, int ms) {
   struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
   struct mg_connection *c;
   fd_set rset, wset;
@@ -3089,7 +4517,7 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
     FD_SET(FD(c), &rset);
     if (FD(c) > maxfd) maxfd = FD(c);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
+    if (c->is_connecting || (mg_send_pending(c) && c->is_tls_hs == 0))
       FD_SET(FD(c), &wset);
   }
 
@@ -3098,6 +4526,7 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     FD_ZERO(&rset);
     FD_ZERO(&wset);
   }
+  mgr->now = mg_millis();
 
   for (c = mgr->conns; c != NULL; c = c->next) {
     // TLS might have stuff buffered, so dig everything
@@ -3106,6 +4535,68 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
                          : FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &rset);
     c->is_writable = FD(c) != INVALID_SOCKET && FD_ISSET(FD(c), &wset);
   }
+}
+#endif
+
+// Wait up to ms for socket events, then set mgr->now
+static void mg_iotest(struct mg_mgr *mgr, int ms) {
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) {
+    mg_uring_iotest(mgr, ms);
+    return;
+  }
+#endif
+#if MG_ARCH == MG_ARCH_FREERTOS
+  struct mg_connection *c;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    FreeRTOS_FD_CLR(c->fd, mgr->ss, eSELECT_WRITE);
+    if (c->is_connecting || (mg_send_pending(c) && c->is_tls_hs == 0))
+      FreeRTOS_FD_SET(c->fd, mgr->ss, eSELECT_WRITE);
+  }
+  FreeRTOS_select(mgr->ss, pdMS_TO_TICKS(ms));
+  mgr->now = mg_millis();
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    EventBits_t bits = FreeRTOS_FD_ISSET(c->fd, mgr->ss);
+    c->is_readable = bits & (eSELECT_READ | eSELECT_EXCEPT) ? 1 : 0;
+    c->is_writable = bits & eSELECT_WRITE ? 1 : 0;
+  }
+#elif MG_ENABLE_EPOLL
+  // Sockets stay registered for their whole lifetime, so unlike select()
+  // there is nothing to rebuild here. The walk below only clears readiness
+  // flags and issues epoll_ctl() for connections whose write interest flipped
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  struct mg_connection *c;
+  int i, n;
+
+  if (mgr->epoll_fd < 0) {
+    mg_select_iotest(mgr, ms);  // epoll_create1() failed in mg_mgr_init()
+    return;
+  }
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    // TLS might have stuff buffered, so dig everything
+    c->is_readable = c->is_tls && c->is_readable ? 1 : 0;
+    c->is_writable = 0;
+    if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
+    mg_epoll_sync(c);
+  }
+
+  if ((n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms)) < 0) {
+    LOG(LL_DEBUG, ("epoll_wait: %d %d", n, MG_SOCK_ERRNO));
+    n = 0;
+  }
+  mgr->now = mg_millis();
+
+  for (i = 0; i < n; i++) {
+    uint32_t bits = evs[i].events;
+    c = (struct mg_connection *) evs[i].data.ptr;
+    if (bits & (EPOLLIN | EPOLLERR | EPOLLHUP)) c->is_readable = 1;
+    if ((bits & EPOLLOUT) ||
+        ((bits & (EPOLLERR | EPOLLHUP)) && c->is_epoll_out)) {
+      c->is_writable = 1;
+    }
+  }
+#else
+  mg_select_iotest(mgr, ms);
 #endif
 }
 
@@ -3126,15 +4617,27 @@ static void connect_conn(struct mg_connection *c) {
 
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
-  unsigned long now;
-
+  long due;
+
+  // Sleep no longer than until the next timer is due
+  if (mgr->timers.count > 0 || g_timers.count > 0) {
+    unsigned long now = mg_millis();
+    due = mg_timers_next(&mgr->timers, now);
+    if (due >= 0 && due < ms) ms = (int) due;
+    due = mg_timers_next(&g_timers, now);
+    if (due >= 0 && due < ms) ms = (int) due;
+  }
+  // The one clock read of this iteration is taken by mg_iotest() right after
+  // it wakes up, before io_uring completions call any handler. Timers,
+  // timeouts and handlers all go by mgr->now until the next one
   mg_iotest(mgr, ms);
-  now = mg_millis();
-  mg_timer_poll(now);
+  mg_timer_poll(mgr->now);
+  mg_timers_poll(&mgr->timers, mgr->now);
+  if (mgr->wakefd < 0) mg_completions_run(mgr);  // Nothing wakes us up
 
   for (c = mgr->conns; c != NULL; c = tmp) {
     tmp = c->next;
-    mg_call(c, MG_EV_POLL, &now);
+    mg_call(c, MG_EV_POLL, &mgr->now);
     LOG(LL_VERBOSE_DEBUG,
         ("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
          c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
@@ -3153,7 +4656,7 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_writable) write_conn(c);
     }
 
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+    if (c->is_draining && !mg_send_pending(c)) c->is_closing = 1;
     if (c->is_closing) close_conn(c);
   }
 }
@@ -3172,7 +4675,7 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
 
 #if MG_ENABLE_SSI
 static char *mg_ssi(const char *path, const char *root, int depth) {
-  struct mg_iobuf b = {NULL, 0, 0};
+  struct mg_iobuf b = {NULL, 0, 0, 0};
   FILE *fp = mg_fopen(path, "rb");
   if (fp != NULL) {
     char buf[BUFSIZ], arg[sizeof(buf)];
@@ -3348,43 +4851,232 @@ struct mg_str mg_strstrip(struct mg_str s) {
 
 
 
-struct mg_timer *g_timers;
+struct mg_timers g_timers;
+
+// Pseudo slot of timers moved to mg_timers::expired
+#define MG_TIMER_EXPIRED (MG_TIMER_LEVELS * MG_TIMER_SLOTS)
+
+static unsigned mg_timer_ctz(uint64_t x) {
+#if defined(__GNUC__)
+  return (unsigned) __builtin_ctzll(x);
+#else
+  unsigned n = 0;
+  while ((x & 1) == 0) x >>= 1, n++;
+  return n;
+#endif
+}
+
+static struct mg_timer **mg_timers_head(struct mg_timers *w, unsigned slot) {
+  if (slot == MG_TIMER_EXPIRED) return &w->expired;
+  return &w->slots[slot >> MG_TIMER_BITS][slot & (MG_TIMER_SLOTS - 1)];
+}
+
+// Put a timer into the slot of its expiration time. Level l takes timers
+// due within 64^(l+1) ticks, so the slot is always cascaded down (or fired)
+// before it comes round again. Beyond the top level the timer is parked in
+// the farthest slot and re-examined when that slot is cascaded
+static void mg_timers_link(struct mg_timers *w, struct mg_timer *t) {
+  unsigned long base = w->now + 1, at = t->expire, delta;
+  unsigned level = 0, slot;
+  if ((long) (at - base) < 0) at = base;  // Overdue: fire on the next tick
+  delta = at - base;
+  while (level < MG_TIMER_LEVELS - 1 &&
+         (delta >> (MG_TIMER_BITS * (level + 1))) != 0) {
+    level++;
+  }
+  if ((delta >> (MG_TIMER_BITS * MG_TIMER_LEVELS)) != 0) {
+    at = base + (1UL << (MG_TIMER_BITS * MG_TIMER_LEVELS)) - 1;
+  }
+  slot = (unsigned) (at >> (MG_TIMER_BITS * level)) & (MG_TIMER_SLOTS - 1);
+  t->wheel = w;
+  t->slot = level * MG_TIMER_SLOTS + slot;
+  t->prev = NULL;
+  t->next = w->slots[level][slot];
+  if (t->next != NULL) t->next->prev = t;
+  w->slots[level][slot] = t;
+  w->used[level] |= (uint64_t) 1 << slot;
+  w->count++;
+}
+
+static void mg_timers_unlink(struct mg_timer *t) {
+  struct mg_timers *w = t->wheel;
+  struct mg_timer **head = mg_timers_head(w, t->slot);
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    *head = t->next;
+  }
+  if (t->next != NULL) t->next->prev = t->prev;
+  if (*head == NULL && t->slot != MG_TIMER_EXPIRED) {
+    w->used[t->slot >> MG_TIMER_BITS] &=
+        ~((uint64_t) 1 << (t->slot & (MG_TIMER_SLOTS - 1)));
+  }
+  t->next = t->prev = NULL;
+  t->wheel = NULL;
+  w->count--;
+}
+
+// Move every timer of a slot into a list linked through `next`
+static struct mg_timer *mg_timers_take(struct mg_timers *w, unsigned level,
+                                       unsigned slot) {
+  struct mg_timer *list = w->slots[level][slot], *t;
+  w->slots[level][slot] = NULL;
+  w->used[level] &= ~((uint64_t) 1 << slot);
+  for (t = list; t != NULL; t = t->next) w->count--;
+  return list;
+}
+
+// First tick after the last processed one at which the wheel has work:
+// a level 0 slot to fire, or a higher level slot to cascade
+static unsigned long mg_timers_due(struct mg_timers *w) {
+  unsigned long base = w->now + 1, due = 0;
+  unsigned level;
+  bool found = false;
+  for (level = 0; level < MG_TIMER_LEVELS; level++) {
+    unsigned shift = level * MG_TIMER_BITS, digit;
+    uint64_t bits = w->used[level];
+    unsigned long q, tick;
+    if (bits == 0) continue;
+    // Slots of this level are visited on multiples of 64^level
+    q = (base + (1UL << shift) - 1) >> shift;
+    digit = (unsigned) (q & (MG_TIMER_SLOTS - 1));
+    if (digit != 0) bits = (bits >> digit) | (bits << (MG_TIMER_SLOTS - digit));
+    tick = (q + mg_timer_ctz(bits)) << shift;
+    if (!found || (long) (tick - due) < 0) due = tick, found = true;
+  }
+  return due;
+}
+
+// The clock went backwards. Shift every timer by the same amount, so each
+// one keeps its remaining time
+static void mg_timers_rewind(struct mg_timers *w, unsigned long now_ms) {
+  struct mg_timer *list = NULL, *t, *next;
+  unsigned long back = w->now - now_ms;
+  unsigned level, slot;
+  for (level = 0; level < MG_TIMER_LEVELS; level++) {
+    for (slot = 0; slot < MG_TIMER_SLOTS; slot++) {
+      for (t = mg_timers_take(w, level, slot); t != NULL; t = next) {
+        next = t->next;
+        t->next = list;
+        list = t;
+      }
+    }
+  }
+  w->now = now_ms;
+  for (t = list; t != NULL; t = next) {
+    next = t->next;
+    t->expire -= back;
+    mg_timers_link(w, t);
+  }
+}
+
+static void mg_timers_arm(struct mg_timers *w, struct mg_timer *t,
+                          unsigned long expire, int ms, int flags,
+                          void (*fn)(void *), void *arg) {
+  t->period_ms = ms;
+  t->flags = flags;
+  t->fn = fn;
+  t->arg = arg;
+  t->expire = expire;
+  mg_timers_link(w, t);
+  if (flags & MG_TIMER_RUN_NOW) fn(arg);
+}
+
+void mg_timers_init(struct mg_timers *w, unsigned long now_ms) {
+  memset(w, 0, sizeof(*w));
+  w->now = now_ms;
+}
+
+// Arm a timer relative to the time of the last mg_timers_poll()
+void mg_timers_add(struct mg_timers *w, struct mg_timer *t, int ms, int flags,
+                   void (*fn)(void *), void *arg) {
+  mg_timers_arm(w, t, w->now + (unsigned long) ms, ms, flags, fn, arg);
+}
+
+void mg_timers_poll(struct mg_timers *w, unsigned long now_ms) {
+  if ((long) (now_ms - w->now) < 0) mg_timers_rewind(w, now_ms);
+  while (w->count > 0) {
+    unsigned long tick = mg_timers_due(w);
+    unsigned level, slot;
+    struct mg_timer *t, *next;
+    if ((long) (tick - now_ms) > 0) break;
+
+    // Cascade the slots that start at this tick, top level first, so that
+    // their timers land in lower levels, as seen from this very tick
+    w->now = tick - 1;
+    for (level = MG_TIMER_LEVELS - 1; level > 0; level--) {
+      unsigned shift = level * MG_TIMER_BITS;
+      if (tick & ((1UL << shift) - 1)) continue;
+      slot = (unsigned) (tick >> shift) & (MG_TIMER_SLOTS - 1);
+      for (t = mg_timers_take(w, level, slot); t != NULL; t = next) {
+        next = t->next;
+        mg_timers_link(w, t);
+      }
+    }
+
+    // Fire. Timers are moved aside first: a repeating one may land in the
+    // same slot again, and callbacks are free to cancel any other timer
+    w->now = tick;
+    slot = (unsigned) tick & (MG_TIMER_SLOTS - 1);
+    w->expired = mg_timers_take(w, 0, slot);
+    for (t = w->expired; t != NULL; t = t->next) {
+      t->slot = MG_TIMER_EXPIRED;
+      w->count++;
+    }
+    while ((t = w->expired) != NULL) {
+      mg_timers_unlink(t);
+      if (t->flags & MG_TIMER_REPEAT) {
+        // Try to tick timers with the given period as accurate as possible,
+        // even if this polling function is called with some random period.
+        t->expire = now_ms - t->expire > (unsigned long) t->period_ms
+                        ? now_ms + t->period_ms
+                        : t->expire + t->period_ms;
+        mg_timers_link(w, t);
+      }
+      t->fn(t->arg);
+    }
+  }
+  w->now = now_ms;
+}
+
+// Milliseconds until the wheel has work, 0 if it is overdue, -1 if nothing
+// is armed. A timer more than 64 ms away may cost one early wakeup per level
+// it is cascaded through
+long mg_timers_next(struct mg_timers *w, unsigned long now_ms) {
+  unsigned long due;
+  if (w->count == 0) return -1;
+  due = mg_timers_due(w);
+  return (long) (due - now_ms) > 0 ? (long) (due - now_ms) : 0;
+}
+
+// Disarm every timer, e.g. before the wheel goes away
+void mg_timers_clear(struct mg_timers *w) {
+  unsigned level, slot;
+  struct mg_timer *t, *next;
+  for (level = 0; level < MG_TIMER_LEVELS; level++) {
+    for (slot = 0; slot < MG_TIMER_SLOTS; slot++) {
+      for (t = mg_timers_take(w, level, slot); t != NULL; t = next) {
+        next = t->next;
+        t->next = t->prev = NULL;
+        t->wheel = NULL;
+      }
+    }
+  }
+}
 
 void mg_timer_init(struct mg_timer *t, int ms, int flags, void (*fn)(void *),
                    void *arg) {
-  struct mg_timer tmp = {ms, flags, fn, arg, 0UL, g_timers};
-  *t = tmp;
-  g_timers = t;
-  if (flags & MG_TIMER_RUN_NOW) fn(arg);
+  unsigned long now = mg_millis();
+  if (g_timers.count == 0) g_timers.now = now;  // Idle wheel, catch up
+  mg_timers_arm(&g_timers, t, now + (unsigned long) ms, ms, flags, fn, arg);
 }
 
 void mg_timer_free(struct mg_timer *t) {
-  struct mg_timer **head = &g_timers;
-  while (*head && *head != t) head = &(*head)->next;
-  if (*head) *head = t->next;
+  if (t->wheel != NULL) mg_timers_unlink(t);
 }
 
 void mg_timer_poll(unsigned long now_ms) {
-  // If time goes back (wrapped around), reset timers
-  struct mg_timer *t, *tmp;
-  static unsigned long oldnow;  // Timestamp in a previous invocation
-  if (oldnow > now_ms) {        // If it is wrapped, reset timers
-    for (t = g_timers; t != NULL; t = t->next) t->expire = 0;
-  }
-  oldnow = now_ms;
-
-  for (t = g_timers; t != NULL; t = tmp) {
-    tmp = t->next;
-    if (t->expire == 0) t->expire = now_ms + t->period_ms;
-    if (t->expire > now_ms) continue;
-    t->fn(t->arg);
-    // Try to tick timers with the given period as accurate as possible,
-    // even if this polling function is called with some random period.
-    t->expire = now_ms - t->expire > (unsigned long) t->period_ms
-                    ? now_ms + t->period_ms
-                    : t->expire + t->period_ms;
-    if (!(t->flags & MG_TIMER_REPEAT)) mg_timer_free(t);
-  }
+  mg_timers_poll(&g_timers, now_ms);
 }
 
 #ifdef MG_ENABLE_LINES
@@ -4181,7 +5873,7 @@ unsigned long mg_millis(void) {
   return xTaskGetTickCount() * portTICK_PERIOD_MS;
 #else
   struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
+  clock_gettime(MG_CLOCK, &ts);
   return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 #endif
 }
@@ -221,6 +221,7 @@ static inline int ff_vfprintf(FF_FILE *fp, const char *fmt, va_list ap) {
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #define MG_DIRSEP '/'
 #define MG_ENABLE_POSIX 1
@@ -336,6 +337,135 @@ typedef int socklen_t;
 #define MG_ENABLE_SOCKETPAIR 1
 #endif
 
+// Cache responses for mg_http_serve_file() in memory: headers and ETag are
+// formatted once, small files are kept resident, medium ones are mmap()-ed.
+// Entries are dropped as soon as inotify(7) reports a change to the file
+#ifndef MG_ENABLE_FILE_CACHE
+#define MG_ENABLE_FILE_CACHE 0
+#endif
+
+#if MG_ENABLE_FILE_CACHE && (!defined(__linux__) || !MG_ENABLE_FS)
+#error "MG_ENABLE_FILE_CACHE requires Linux and MG_ENABLE_FS"
+#endif
+
+// Files up to this size are read into memory, larger ones are mmap()-ed
+#ifndef MG_FILE_CACHE_RESIDENT_MAX
+#define MG_FILE_CACHE_RESIDENT_MAX (64 * 1024)
+#endif
+
+// Files larger than this are not cached, they are streamed from disk
+#ifndef MG_FILE_CACHE_MMAP_MAX
+#define MG_FILE_CACHE_MMAP_MAX (16 * 1024 * 1024)
+#endif
+
+// Maximum number of cached responses per manager
+#ifndef MG_FILE_CACHE_MAX_ENTRIES
+#define MG_FILE_CACHE_MAX_ENTRIES 1024
+#endif
+
+// Use Linux epoll(7) instead of select() to wait for socket events
+#ifndef MG_ENABLE_EPOLL
+#define MG_ENABLE_EPOLL 0
+#endif
+
+#if MG_ENABLE_EPOLL && !defined(__linux__)
+#error "MG_ENABLE_EPOLL requires Linux"
+#endif
+
+// Maximum number of events returned by one epoll_wait() call
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 1024
+#endif
+
+// Drive sockets through io_uring (Linux 5.19+). If the kernel refuses to set
+// up a ring, mg_mgr_init() falls back to epoll or select() at runtime
+#ifndef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0
+#endif
+
+#if MG_ENABLE_IO_URING && !defined(__linux__)
+#error "MG_ENABLE_IO_URING requires Linux"
+#endif
+
+// Size of the io_uring submission queue. Completion queue is 4 times larger
+#ifndef MG_IO_URING_ENTRIES
+#define MG_IO_URING_ENTRIES 256
+#endif
+
+// Number (power of two) and size of the kernel-provided receive buffers
+#ifndef MG_IO_URING_BUFS
+#define MG_IO_URING_BUFS 1024
+#endif
+
+#ifndef MG_IO_URING_BUF_SIZE
+#define MG_IO_URING_BUF_SIZE 4096
+#endif
+
+// Queue large mg_send_ref() data by reference and flush it with sendmsg()
+#ifndef MG_ENABLE_SENDQ
+#define MG_ENABLE_SENDQ (MG_ARCH == MG_ARCH_UNIX && !MG_ENABLE_LWIP)
+#endif
+
+// Stream files queued with mg_send_fd() straight to the socket
+#ifndef MG_ENABLE_SENDFILE
+#if defined(__linux__)
+#define MG_ENABLE_SENDFILE MG_ENABLE_SENDQ
+#else
+#define MG_ENABLE_SENDFILE 0
+#endif
+#endif
+
+// Most bytes one sendfile() call may push, so that a download yields to
+// other connections after each chunk
+#ifndef MG_SENDFILE_CHUNK
+#define MG_SENDFILE_CHUNK (256 * 1024)
+#endif
+
+// Maximum number of iovecs passed to one sendmsg() call
+#ifndef MG_SENDQ_IOV
+#define MG_SENDQ_IOV 16
+#endif
+
+// Recycle IO buffers through a per-thread pool of power-of-two size classes,
+// MG_IO_SIZE to MG_IO_SIZE << (MG_BUFPOOL_CLASSES - 1) bytes
+#ifndef MG_ENABLE_BUFPOOL
+#define MG_ENABLE_BUFPOOL (MG_ARCH == MG_ARCH_UNIX)
+#endif
+
+#ifndef MG_BUFPOOL_CLASSES
+#define MG_BUFPOOL_CLASSES 8
+#endif
+
+// Free buffers kept per size class
+#ifndef MG_BUFPOOL_DEPTH
+#define MG_BUFPOOL_DEPTH 16
+#endif
+
+// Closed connections kept by each manager for reuse
+#ifndef MG_CONN_FREELIST_MAX
+#define MG_CONN_FREELIST_MAX 256
+#endif
+
+// Wake mg_mgr_poll() up through an eventfd when mg_complete() queues work.
+// Without it, completions are picked up once per poll
+#ifndef MG_ENABLE_EVENTFD
+#if defined(__linux__)
+#define MG_ENABLE_EVENTFD (MG_ARCH == MG_ARCH_UNIX && !MG_ENABLE_LWIP)
+#else
+#define MG_ENABLE_EVENTFD 0
+#endif
+#endif
+
+// Default listen() backlog, see struct mg_mgr :: backlog
+#ifndef MG_LISTEN_BACKLOG
+#define MG_LISTEN_BACKLOG 128
+#endif
+
+// Default number of connections accepted per listener per mg_mgr_poll()
+#ifndef MG_ACCEPT_BUDGET
+#define MG_ACCEPT_BUDGET 64
+#endif
+
 // Granularity of the send/recv IO buffer growth
 #ifndef MG_IO_SIZE
 #define MG_IO_SIZE 512
@@ -346,6 +476,12 @@ typedef int socklen_t;
 #define MG_MAX_RECV_BUF_SIZE (3 * 1024 * 1024)
 #endif
 
+// How many bytes one connection may read per mg_mgr_poll() before others
+// get their turn
+#ifndef MG_READ_BUDGET
+#define MG_READ_BUDGET (256 * 1024)
+#endif
+
 #ifndef MG_MAX_HTTP_HEADERS
 #define MG_MAX_HTTP_HEADERS 40
 #endif
@@ -401,6 +537,15 @@ void mg_log_set_callback(void (*fn)(const void *, int, void *), void *param);
 #endif
 
 
+#ifndef MG_TIMER_LEVELS
+#define MG_TIMER_LEVELS 4  // Wheel levels, each one 64 times coarser
+#endif
+
+#define MG_TIMER_BITS 6
+#define MG_TIMER_SLOTS (1 << MG_TIMER_BITS)
+
+struct mg_timers;
+
 struct mg_timer {
   int period_ms;            // Timer period in milliseconds
   int flags;                // Possible flags values below
@@ -409,15 +554,36 @@ struct mg_timer {
   void (*fn)(void *);       // Function to call
   void *arg;                // Function agrument
   unsigned long expire;     // Expiration timestamp in milliseconds
-  struct mg_timer *next;    // Linkage in g_timers list
+  struct mg_timer *next;    // Linkage in a wheel slot
+  struct mg_timer *prev;    // Previous timer in the slot, NULL if first
+  struct mg_timers *wheel;  // Wheel the timer is armed on, NULL if not armed
+  unsigned slot;            // Level * MG_TIMER_SLOTS + slot within the level
+};
+
+// Hierarchical timing wheel with 1 millisecond ticks. Level 0 holds timers
+// due in the next 64 ms, level 1 in the next 64 * 64 ms, and so on. Arming
+// and cancelling is O(1), a poll only visits slots that have timers in them
+struct mg_timers {
+  unsigned long now;                        // Last processed tick
+  size_t count;                             // Number of armed timers
+  struct mg_timer *expired;                 // Timers being fired
+  uint64_t used[MG_TIMER_LEVELS];           // Non-empty slots of each level
+  struct mg_timer *slots[MG_TIMER_LEVELS][MG_TIMER_SLOTS];
 };
 
-extern struct mg_timer *g_timers;  // Global list of timers
+extern struct mg_timers g_timers;  // Global wheel used by mg_timer_init()
 
 void mg_timer_init(struct mg_timer *, int ms, int, void (*fn)(void *), void *);
 void mg_timer_free(struct mg_timer *);
 void mg_timer_poll(unsigned long uptime_ms);
 
+void mg_timers_init(struct mg_timers *, unsigned long now_ms);
+void mg_timers_add(struct mg_timers *, struct mg_timer *, int ms, int flags,
+                   void (*fn)(void *), void *arg);
+void mg_timers_poll(struct mg_timers *, unsigned long now_ms);
+long mg_timers_next(struct mg_timers *, unsigned long now_ms);
+void mg_timers_clear(struct mg_timers *);
+
 
 
 
@@ -439,6 +605,10 @@ unsigned long mg_unhexn(const char *s, int len);
 int mg_asprintf(char **buf, size_t size, const char *fmt, ...);
 int mg_vasprintf(char **buf, size_t size, const char *fmt, va_list ap);
 int64_t mg_to64(struct mg_str str);
+#ifndef MG_CLOCK
+#define MG_CLOCK CLOCK_MONOTONIC  // clock_gettime() clock behind mg_millis()
+#endif
+
 double mg_time(void);
 unsigned long mg_millis(void);
 void mg_usleep(unsigned long usecs);
@@ -515,9 +685,12 @@ const char *mg_url_uri(const char *url);
 
 #include <stddef.h>
 
+// Deleting from the front only advances `buf`. The consumed prefix, `head`
+// bytes long, is reclaimed when the buffer runs out of room or empties
 struct mg_iobuf {
-  unsigned char *buf;
-  size_t size, len;
+  unsigned char *buf;  // Start of data, `head` bytes into the allocation
+  size_t size, len;    // Capacity from `buf` on, and length of data
+  size_t head;         // Bytes consumed in front of `buf`
 };
 
 int mg_iobuf_init(struct mg_iobuf *, size_t);
@@ -562,6 +735,7 @@ void mg_hmac_sha1(const unsigned char *key, size_t key_len,
 
 
 struct mg_connection;
+struct mg_completion;
 typedef void (*mg_event_handler_t)(struct mg_connection *, int ev,
                                    void *ev_data, void *fn_data);
 void mg_call(struct mg_connection *c, int ev, void *ev_data);
@@ -606,26 +780,106 @@ struct mg_addr {
   bool is_ip6;      // True when address is IPv6 address
 };
 
+// TCP options applied to listeners, and to outbound and accepted connections
+struct mg_sockopts {
+  bool nodelay;   // TCP_NODELAY, disable Nagle's algorithm
+  bool quickack;  // TCP_QUICKACK, where supported
+  int keepidle;   // Seconds of idle before keep-alive probes, 0 disables them
+  int keepintvl;  // Seconds between keep-alive probes
+  int keepcnt;    // Unanswered probes before the connection is dropped
+};
+
+// Timeouts of accepted HTTP connections in milliseconds, 0 disables one.
+// Head and body timeouts run from the first byte of the request head and
+// body, so a client trickling bytes does not get more time
+struct mg_timeouts {
+  int header_ms;  // Complete request head must arrive within
+  int body_ms;    // Complete request body must arrive within
+  int idle_ms;    // Keep-alive connection may sit idle between requests
+  int write_ms;   // Queued response may make no send progress for
+};
+
+// Allocator counters, see mg_mgr_stats(). The conn_ ones belong to the
+// manager. IO buffers are pooled per thread, not per manager, so the buf_
+// ones are those of the thread calling mg_mgr_stats(): call it from the
+// thread running the manager's mg_mgr_poll(), anywhere else they describe
+// an unrelated pool
+struct mg_alloc_stats {
+  unsigned long conn_hits;    // Connections reused from the manager's freelist
+  unsigned long conn_misses;  // Connections allocated with calloc()
+  unsigned long buf_hits;     // IO buffers reused from the calling thread's pool
+  unsigned long buf_misses;   // IO buffers allocated with malloc()
+  size_t buf_cached;          // Bytes held by the calling thread's pool
+};
+
 struct mg_mgr {
   struct mg_connection *conns;  // List of active connections
   struct mg_dns dns4;           // DNS for IPv4
   struct mg_dns dns6;           // DNS for IPv6
   int dnstimeout;               // DNS resolve timeout in milliseconds
+  bool reuseport;               // Set SO_REUSEPORT on new listeners
+  int backlog;                  // listen() backlog for new listeners
+  int accept_budget;            // Max accepts per listener per mg_mgr_poll()
+  struct mg_sockopts sockopts;  // Options for new TCP sockets
+  struct mg_timeouts timeouts;  // Reaping of slow and idle HTTP clients
   unsigned long nextid;         // Next connection ID
   void *userdata;               // Arbitrary user data pointer
+  struct mg_connection **idmap;  // Connections hashed by ID
+  size_t idmap_size, idmap_count;  // Number of buckets and entries in idmap
+  struct mg_connection *spare;  // Closed connections kept for reuse
+  size_t spare_count;           // Length of the spare list
+  unsigned long conn_hits, conn_misses;  // See struct mg_alloc_stats
+  struct mg_timers timers;      // Timers polled by mg_mgr_poll()
+  unsigned long now;            // mg_millis() as of this mg_mgr_poll()
+  struct mg_completion *completions;  // Queued by mg_complete(), newest first
+  int wakefd;                   // eventfd poked by mg_complete(), or -1
 #if MG_ARCH == MG_ARCH_FREERTOS
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
+#if MG_ENABLE_EPOLL
+  int epoll_fd;  // Persistent interest set, see mg_iotest()
+#endif
+#if MG_ENABLE_IO_URING
+  void *uring;  // io_uring state, NULL if the ring could not be set up
+#endif
+#if MG_ENABLE_FILE_CACHE
+  void *fcache;  // Cached mg_http_serve_file() responses
+#endif
+};
+
+// Caller-owned data queued with mg_send_ref() or mg_send_fd(). It goes out
+// after the `at` bytes of c->send queued between the previous entry and it
+struct mg_sendref {
+  struct mg_sendref *next;  // Next entry in struct mg_connection :: sendq
+  const char *ptr;          // Data not sent yet
+  int fd;                   // Or, if not -1, file to send from
+  size_t offset;            // File offset of data not sent yet
+  size_t len;               // Length of data not sent yet
+  size_t at;                // Bytes of c->send that go out before this entry
+  void (*release)(void *);  // Called when the data is sent or dropped
+  void *release_arg;        // Argument for release
 };
 
 struct mg_connection {
   struct mg_connection *next;  // Linkage in struct mg_mgr :: connections
+  struct mg_connection *id_next;  // Linkage in struct mg_mgr :: idmap
   struct mg_mgr *mgr;          // Our container
   struct mg_addr peer;         // Remote peer address
   void *fd;                    // Connected socket, or LWIP data
   unsigned long id;            // Auto-incrementing unique connection ID
   struct mg_iobuf recv;        // Incoming data
   struct mg_iobuf send;        // Outgoing data
+  size_t recv_hint;            // Expected recv.len of current message, or 0
+  struct mg_sendref *sendq;    // Data queued by reference, sent after `send`
+  struct mg_sendref *sendq_last;  // Tail of sendq
+  size_t sendq_mark;           // Bytes of send queued before sendq_last
+  struct mg_timer timer;       // Fires at deadline, see struct mg_timeouts
+  unsigned long deadline;      // End of the current phase, 0 if unlimited
+  unsigned char phase;         // HTTP server phase, values below
+#define MG_HTTP_PHASE_HEAD 1   // Reading a request head
+#define MG_HTTP_PHASE_BODY 2   // Reading a request body
+#define MG_HTTP_PHASE_WRITE 3  // Sending a response
+#define MG_HTTP_PHASE_IDLE 4   // Waiting for the next request
   mg_event_handler_t fn;       // User-specified event handler function
   void *fn_data;               // User-speficied function parameter
   int socketpair_socket;        // The non-blocking socket to receive data from thread
@@ -647,20 +901,46 @@ struct mg_connection {
   unsigned is_closing : 1;     // Close and free the connection immediately
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_epoll_out : 1;   // EPOLLOUT is in the epoll interest set
+  unsigned is_uring_armed : 1;  // Multishot accept/recv or POLLIN pending
+  unsigned is_uring_out : 1;    // io_uring POLLOUT request pending
+  unsigned is_uring_sending : 1;  // io_uring send request in flight
+  unsigned is_raw_fd : 1;      // Not a socket, see mg_watch_fd()
+  unsigned is_suspended : 1;   // Request being handled elsewhere, see mg_http_resume()
+};
+
+// Work done for a connection on another thread, handed back to the event
+// loop with mg_complete(). Embed it in a struct that carries the result
+struct mg_completion {
+  struct mg_completion *next;  // Linkage in struct mg_mgr :: completions
+  unsigned long conn_id;       // Connection the work was done for
+  // Called on the event loop thread, with NULL if the connection has gone
+  // away meanwhile. The completion belongs to fn from then on
+  void (*fn)(struct mg_connection *, struct mg_completion *);
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
 void mg_mgr_init(struct mg_mgr *);
 void mg_mgr_free(struct mg_mgr *);
+void mg_complete(struct mg_mgr *, struct mg_completion *);
+void mg_completions_run(struct mg_mgr *);  // Run the queued ones now
 
 struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
                                 mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_connect(struct mg_mgr *, const char *url,
                                  mg_event_handler_t fn, void *fn_data);
 int mg_send(struct mg_connection *, const void *, size_t);
+int mg_send_ref(struct mg_connection *, const void *buf, size_t len,
+                void (*release)(void *), void *release_arg);
+bool mg_send_fd(struct mg_connection *, int fd, size_t offset, size_t len,
+                void (*release)(void *), void *release_arg);
 int mg_printf(struct mg_connection *, const char *fmt, ...);
 int mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
 char *mg_straddr(struct mg_connection *, char *, size_t);
+struct mg_connection *mg_conn_by_id(struct mg_mgr *, unsigned long id);
+void mg_mgr_stats(struct mg_mgr *, struct mg_alloc_stats *);  // From the loop
+struct mg_connection *mg_watch_fd(struct mg_mgr *, int fd,
+                                  mg_event_handler_t fn, void *fn_data);
 bool mg_socketpair(int *s1, int *s2);
 bool mg_aton(struct mg_str str, struct mg_addr *addr);
 char *mg_ntoa(const struct mg_addr *addr, char *buf, size_t len);
@@ -698,6 +978,7 @@ int mg_http_get_request_len(const unsigned char *buf, size_t buf_len);
 void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
 void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm);
+void mg_http_resume(struct mg_connection *c);
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
@@ -6,15 +6,535 @@ Note:   Huge thanks to https://nachtimwald.com/2019/04/12/thread-pool-in-c/
 */
 
 #include "ThreadPool.hpp"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
 
-void worker(ThreadPool *pool);
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
 
-job::job(std::function<void (void *)> func, void *args) {
-    this->func = func;
-    this->args = args;
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+// Most jobs a worker moves from the shared queue into its own deque at a time
+#define INJECT_BATCH 16
+
+// Most spare deque nodes a worker keeps
+#define NODE_CACHE_MAX 256
+
+// Initial capacity of a lane's shared queue. It doubles when full
+#define SHARED_QUEUE_INITIAL 256
+
+void worker(ThreadPool *pool, size_t index);
+
+// The pool and index of the worker running on this thread, if any
+static thread_local ThreadPool *currentPool = NULL;
+static thread_local size_t currentIndex = 0;
+
+/*
+Function:   cpuRelax
+Desc:       Tell the CPU we're spinning, which saves power and lets the sibling hyper-thread run
+*/
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#if defined(__linux__)
+// For internal use only. Where a CPU sits, read from sysfs
+typedef struct _cpuInfo {
+    int cpu;
+    int node;       // NUMA node
+    int package;    // Socket
+    int core;       // Physical core within the socket
+    int sibling;    // Position among the hyper-threads of its core
+} cpuInfo;
+
+/*
+Function:   readCpuList
+Desc:       Parse a sysfs CPU list, e.g. "0-3,8-11"
+Args:       path: The file to read
+Return:     The CPUs, empty if the file can't be read
+*/
+static std::vector<int> readCpuList(const std::string &path) {
+    std::vector<int> cpus;
+    std::ifstream file(path);
+    std::string range;
+
+    while (std::getline(file, range, ',')) {
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/*
+Function:   readNumber
+Desc:       Read a number from a sysfs file
+Args:       path: The file to read
+Return:     The number, 0 if the file can't be read
+*/
+static int readNumber(const std::string &path) {
+    std::ifstream file(path);
+    int value = 0;
+    file >> value;
+    return value;
+}
+
+/*
+Function:   cpuTopology
+Desc:       Find the CPUs the process may run on and where they sit. Read once, on first use
+Return:     The CPUs in compact order: by NUMA node, socket, core, then hyper-thread
+*/
+static const std::vector<cpuInfo> &cpuTopology() {
+    static const std::vector<cpuInfo> topology = [] {
+        std::vector<cpuInfo> cpus;
+        cpu_set_t allowed;
+
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return cpus;
+        }
+        for (int cpu : readCpuList("/sys/devices/system/cpu/online")) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+                cpus.push_back({ cpu, 0, readNumber(dir + "physical_package_id"), readNumber(dir + "core_id"), 0 });
+            }
+        }
+
+        // Without NUMA support in the kernel there's no node directory, everything is node 0
+        DIR *nodes = opendir("/sys/devices/system/node");
+        struct dirent *entry;
+        while (nodes != NULL && (entry = readdir(nodes)) != NULL) {
+            if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9') {
+                continue;
+            }
+            int node = std::atoi(entry->d_name + 4);
+            for (int cpu : readCpuList(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist")) {
+                for (cpuInfo &info : cpus) {
+                    if (info.cpu == cpu) {
+                        info.node = node;
+                    }
+                }
+            }
+        }
+        if (nodes != NULL) {
+            closedir(nodes);
+        }
+
+        std::sort(cpus.begin(), cpus.end(), [](const cpuInfo &a, const cpuInfo &b) {
+            if (a.node != b.node) return a.node < b.node;
+            if (a.package != b.package) return a.package < b.package;
+            if (a.core != b.core) return a.core < b.core;
+            return a.cpu < b.cpu;
+        });
+        for (size_t i = 1; i < cpus.size(); i++) {
+            if (cpus[i].node == cpus[i - 1].node && cpus[i].package == cpus[i - 1].package &&
+                cpus[i].core == cpus[i - 1].core) {
+                cpus[i].sibling = cpus[i - 1].sibling + 1;
+            }
+        }
+        return cpus;
+    }();
+    return topology;
+}
+
+/*
+Function:   scatterOrder
+Desc:       Order CPUs so that consecutive threads land on different NUMA nodes, and on different physical
+.           cores before any core gets a second thread
+Args:       cpus: The CPUs in compact order
+Return:     The CPUs in scatter order
+*/
+static std::vector<cpuInfo> scatterOrder(const std::vector<cpuInfo> &cpus) {
+    std::vector<std::vector<cpuInfo>> perNode;
+    std::vector<cpuInfo> order;
+
+    for (const cpuInfo &info : cpus) {
+        if (perNode.empty() || perNode.back().front().node != info.node) {
+            perNode.emplace_back();
+        }
+        perNode.back().push_back(info);
+    }
+    for (std::vector<cpuInfo> &node : perNode) {
+        std::stable_sort(node.begin(), node.end(), [](const cpuInfo &a, const cpuInfo &b) {
+            return a.sibling < b.sibling;
+        });
+    }
+    for (size_t i = 0; order.size() < cpus.size(); i++) {
+        for (std::vector<cpuInfo> &node : perNode) {
+            if (i < node.size()) {
+                order.push_back(node[i]);
+            }
+        }
+    }
+    return order;
+}
+#endif
+
+int pinThread(const affinityPolicy &policy, size_t index) {
+#if defined(__linux__)
+    const std::vector<cpuInfo> &cpus = cpuTopology();
+    cpu_set_t set;
+    int node = -1;
+
+    CPU_ZERO(&set);
+    if (policy.mode == AFFINITY_COMPACT && !cpus.empty()) {
+        const cpuInfo &target = cpus[index % cpus.size()];
+        CPU_SET(target.cpu, &set);
+        node = target.node;
+    }
+    else if (policy.mode == AFFINITY_SCATTER && !cpus.empty()) {
+        static const std::vector<cpuInfo> scattered = scatterOrder(cpus);
+        const cpuInfo &target = scattered[index % scattered.size()];
+        CPU_SET(target.cpu, &set);
+        node = target.node;
+    }
+    else if (policy.mode == AFFINITY_CPUS && !policy.cpus.empty()) {
+        int cpu = policy.cpus[index % policy.cpus.size()];
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            return -1;
+        }
+        CPU_SET(cpu, &set);
+        for (const cpuInfo &info : cpus) {
+            if (info.cpu == cpu) {
+                node = info.node;
+            }
+        }
+    }
+    else if (policy.mode == AFFINITY_NODE) {
+        for (const cpuInfo &info : cpus) {
+            if (info.node == policy.node) {
+                CPU_SET(info.cpu, &set);
+                node = info.node;
+            }
+        }
+    }
+
+    if (CPU_COUNT(&set) == 0 || pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        return -1;
+    }
+    return node;
+#else
+    (void)policy;
+    (void)index;
+    return -1;
+#endif
+}
+
+WorkStealingDeque::WorkStealingDeque(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring *initial = new ring;
+    initial->mask = size - 1;
+    initial->items = new std::atomic<jobNode *>[size];
+    this->top.store(0, std::memory_order_relaxed);
+    this->bottom.store(0, std::memory_order_relaxed);
+    this->array.store(initial, std::memory_order_relaxed);
+}
+
+WorkStealingDeque::~WorkStealingDeque() {
+    this->retired.push_back(this->array.load(std::memory_order_relaxed));
+    for (ring *r : this->retired) {
+        delete[] r->items;
+        delete r;
+    }
+}
+
+/*
+Function:   grow
+Desc:       Owner only. Copy the elements into a ring twice as large
+Args:       old: The current ring
+.           top, bottom: The elements to copy
+Return:     The new ring
+*/
+WorkStealingDeque::ring *WorkStealingDeque::grow(ring *old, long long top, long long bottom) {
+    ring *bigger = new ring;
+    bigger->mask = old->mask * 2 + 1;
+    bigger->items = new std::atomic<jobNode *>[bigger->mask + 1];
+    for (long long i = top; i < bottom; i++) {
+        bigger->items[i & bigger->mask].store(old->items[i & old->mask].load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    }
+
+    // A thief may still be reading the old ring, keep it until the deque is destroyed
+    this->retired.push_back(old);
+    this->array.store(bigger, std::memory_order_release);
+    return bigger;
+}
+
+void WorkStealingDeque::push(jobNode *item) {
+    long long b = this->bottom.load(std::memory_order_relaxed);
+    long long t = this->top.load(std::memory_order_acquire);
+    ring *a = this->array.load(std::memory_order_relaxed);
+
+    if (b - t > (long long)a->mask) {
+        a = this->grow(a, t, b);
+    }
+    a->items[b & a->mask].store(item, std::memory_order_relaxed);
+    this->bottom.store(b + 1, std::memory_order_release);
+}
+
+jobNode *WorkStealingDeque::pop() {
+    long long b = this->bottom.load(std::memory_order_relaxed) - 1;
+    ring *a = this->array.load(std::memory_order_relaxed);
+    this->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long long t = this->top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        this->bottom.store(b + 1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    jobNode *item = a->items[b & a->mask].load(std::memory_order_relaxed);
+    if (t == b) {
+        // Last element, race the thieves for it
+        if (!this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            item = NULL;
+        }
+        this->bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+}
+
+jobNode *WorkStealingDeque::steal() {
+    long long t = this->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long long b = this->bottom.load(std::memory_order_acquire);
+
+    if (t >= b) {
+        return NULL;
+    }
+
+    ring *a = this->array.load(std::memory_order_acquire);
+    jobNode *item = a->items[t & a->mask].load(std::memory_order_relaxed);
+    if (!this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        // Another thief or the owner took it
+        return NULL;
+    }
+    return item;
+}
+
+bool WorkStealingDeque::empty() const {
+    long long t = this->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    long long b = this->bottom.load(std::memory_order_acquire);
+    return t >= b;
+}
+
+BoundedJobQueue::BoundedJobQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    this->slots = new slot[size];
+    this->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        this->slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    this->head.store(0, std::memory_order_relaxed);
+    this->tail.store(0, std::memory_order_relaxed);
+}
+
+BoundedJobQueue::~BoundedJobQueue() {
+    delete[] this->slots;
+}
+
+bool BoundedJobQueue::push(job &newJob) {
+    size_t pos = this->tail.load(std::memory_order_relaxed);
+    slot *cell;
+
+    for (;;) {
+        cell = &this->slots[pos & this->mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        long long diff = (long long)sequence - (long long)pos;
+        if (diff == 0) {
+            // The slot is free, claim it
+            if (this->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // The slot still holds the job from one lap ago: full
+            return false;
+        }
+        else {
+            // Another producer claimed it, try the next one
+            pos = this->tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->work = std::move(newJob);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool BoundedJobQueue::pop(job &found) {
+    size_t pos = this->head.load(std::memory_order_relaxed);
+    slot *cell;
+
+    for (;;) {
+        cell = &this->slots[pos & this->mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        long long diff = (long long)sequence - (long long)(pos + 1);
+        if (diff == 0) {
+            // The slot holds a job, claim it
+            if (this->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // Empty
+            return false;
+        }
+        else {
+            // Another consumer claimed it, try the next one
+            pos = this->head.load(std::memory_order_relaxed);
+        }
+    }
+
+    found = std::move(cell->work);
+    cell->sequence.store(pos + this->mask + 1, std::memory_order_release);
+    return true;
+}
+
+size_t BoundedJobQueue::size() const {
+    size_t head = this->head.load(std::memory_order_seq_cst);
+    size_t tail = this->tail.load(std::memory_order_seq_cst);
+    return tail > head ? tail - head : 0;
+}
+
+#define EVENT_WAITER (1ULL << 32)
+#define EVENT_EPOCH(state) ((unsigned)(state))
+#define EVENT_WAITERS(state) ((unsigned)((state) >> 32))
+
+unsigned EventCount::prepareWait() {
+    return EVENT_EPOCH(this->state.fetch_add(EVENT_WAITER, std::memory_order_seq_cst));
+}
+
+bool EventCount::commitWait(unsigned key, unsigned timeout) {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    // A notification since prepareWait has moved the epoch on and claimed a waiter for us
+#if defined(__linux__)
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the futex word is the low half of state");
+    while (EVENT_EPOCH(this->state.load(std::memory_order_acquire)) == key) {
+        struct timespec left, *wait = NULL;
+        if (timeout != 0) {
+            long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (nanoseconds <= 0) {
+                return !this->cancelWait(key);
+            }
+            left.tv_sec = (time_t)(nanoseconds / 1000000000);
+            left.tv_nsec = (long)(nanoseconds % 1000000000);
+            wait = &left;
+        }
+        syscall(SYS_futex, (unsigned *)&this->state, FUTEX_WAIT_PRIVATE, key, wait, NULL, 0);
+    }
+#else
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (EVENT_EPOCH(this->state.load(std::memory_order_acquire)) == key) {
+        if (timeout == 0) {
+            this->cond.wait(lock);
+        }
+        else if (this->cond.wait_until(lock, deadline) == std::cv_status::timeout) {
+            lock.unlock();
+            return !this->cancelWait(key);
+        }
+    }
+#endif
+    return true;
+}
+
+bool EventCount::cancelWait(unsigned key) {
+    unsigned long long current = this->state.load(std::memory_order_relaxed);
+    do {
+        if (EVENT_EPOCH(current) != key) {
+            // Someone claimed a waiter meanwhile, it counts as ours
+            return false;
+        }
+    } while (!this->state.compare_exchange_weak(current, current - EVENT_WAITER, std::memory_order_seq_cst));
+    return true;
+}
+
+bool EventCount::notify() {
+    return this->wake(false);
 }
 
-void ThreadPool::init(size_t threadCount, size_t maxJobCount) {
+bool EventCount::notifyAll() {
+    return this->wake(true);
+}
+
+size_t EventCount::waiters() const {
+    return EVENT_WAITERS(this->state.load(std::memory_order_relaxed));
+}
+
+/*
+Function:   wake
+Desc:       Claim waiters, start a new epoch and wake up sleepers
+Args:       all: Claim and wake up all of them, otherwise one
+Return:     Whether there was a waiter
+*/
+bool EventCount::wake(bool all) {
+    // Pairs with prepareWait: either the waiter sees the new job, or this sees the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    unsigned long long current = this->state.load(std::memory_order_seq_cst);
+    unsigned long long next;
+    do {
+        if (EVENT_WAITERS(current) == 0) {
+            return false;
+        }
+        unsigned long long waiters = all ? 0 : EVENT_WAITERS(current) - 1;
+        next = (waiters << 32) | (unsigned)(EVENT_EPOCH(current) + 1);
+    } while (!this->state.compare_exchange_weak(current, next, std::memory_order_seq_cst));
+
+#if defined(__linux__)
+    syscall(SYS_futex, (unsigned *)&this->state, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+#else
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (all) {
+        this->cond.notify_all();
+    }
+    else {
+        this->cond.notify_one();
+    }
+#endif
+    return true;
+}
+
+ThreadPool::~ThreadPool() {
+    this->shutdown(true);
+    for (jobLane &lane : this->lanes) {
+        delete lane.bounded;
+    }
+}
+
+void ThreadPool::init(size_t threadCount, size_t maxJobCount, const affinityPolicy &affinity) {
     if (threadCount == 0) {
         return;
     }
@@ -22,43 +542,400 @@ void ThreadPool::init(size_t threadCount, size_t maxJobCount) {
     this->threadCount = threadCount;
     this->workingCount = 0;
     this->stop = false;
+    this->discardJobs = false;
     this->maxJobCount = maxJobCount;
-    
+    this->affinity = affinity;
+    for (jobLane &lane : this->lanes) {
+        if (!lane.hasLimit) {
+            lane.maxJobCount = maxJobCount;
+        }
+        if (lane.maxJobCount != 0) {
+            lane.bounded = new BoundedJobQueue(lane.maxJobCount);
+        }
+        else {
+            lane.ring.resize(SHARED_QUEUE_INITIAL);
+        }
+    }
+
+    // Every worker sets up its own state once it's pinned, see startWorker
+    size_t reserved = this->reservedCount < threadCount ? this->reservedCount : threadCount - 1;
+    this->reservedCount = reserved;
+    size_t slots = threadCount;
+    bool elastic = this->elastic.maxThreads > this->elastic.minThreads;
+    if (elastic) {
+        if (this->elastic.minThreads < reserved + 1) {
+            this->elastic.minThreads = reserved + 1;
+        }
+        if (this->elastic.maxThreads < this->elastic.minThreads) {
+            this->elastic.maxThreads = this->elastic.minThreads;
+        }
+        threadCount = std::min(std::max(threadCount, this->elastic.minThreads), this->elastic.maxThreads);
+        slots = this->elastic.maxThreads;
+    }
+    this->threadCount = threadCount;
+
+    std::vector<std::atomic<workerInfo *>> infos(slots);
+    for (std::atomic<workerInfo *> &info : infos) {
+        info.store(NULL, std::memory_order_relaxed);
+    }
+    this->workers.swap(infos);
+    this->threads.resize(slots);
+    this->slotUsed.assign(slots, false);
+
+    std::unique_lock<std::mutex> lock(this->workMutex);
     for (size_t i = 0; i < threadCount; i++) {
-        std::thread(worker, this).detach();
+        this->slotUsed[i] = true;
+        this->threads[i] = std::thread(worker, this, i);
+    }
+    while (this->startedCount < threadCount) {
+        this->startedCond.wait(lock);
+    }
+    if ((elastic || this->trackingWait) && !this->monitorThread.joinable()) {
+        this->monitorThread = std::thread(&ThreadPool::monitor, this);
     }
 }
 
-void ThreadPool::shutdown(bool finishRemainingJobs) {
-    this->workMutex.lock();
-    while (!this->jobQueue.empty()) {
-        if (finishRemainingJobs) {
-            // Finish all jobs in the queue, one by one
-            job currentJob = this->jobQueue.front();
-            if (currentJob.func) {
-                currentJob.func(currentJob.args);
+/*
+Function:   startWorker
+Desc:       For internal use only. Pin the worker as set by init, then allocate its state, so its deque and
+.           spare nodes live on the worker's own NUMA node. A worker started in a slot that had one
+.           before takes over its state, it's pinned the same way
+Args:       index: The worker's slot
+Return:     The worker's state
+*/
+workerInfo *ThreadPool::startWorker(size_t index) {
+    int node = pinThread(this->affinity, index);
+    workerInfo *info = this->workers[index].load(std::memory_order_acquire);
+
+    if (info == NULL) {
+        info = new workerInfo;
+        info->seed = (unsigned)index * 2654435761u + 1;
+        info->freeNodes = NULL;
+        info->freeCount = 0;
+        info->reserved = index < this->reservedCount;
+        info->node = node;
+    }
+
+    std::lock_guard<std::mutex> lock(this->workMutex);
+    this->workers[index].store(info, std::memory_order_release);
+    for (std::atomic<workerInfo *> &slot : this->workers) {
+        workerInfo *other = slot.load(std::memory_order_relaxed);
+        if (other != NULL && other->node != node) {
+            this->multiNode = true;
+        }
+    }
+    this->startedCount++;
+    this->startedCond.notify_all();
+    return info;
+}
+
+/*
+Function:   spawnWorkers
+Desc:       Start workers in free slots, up to the elasticPolicy's maxThreads. workMutex must be held
+Args:       count: Number of workers to start
+*/
+void ThreadPool::spawnWorkers(size_t count) {
+    for (size_t i = this->reservedCount; i < this->slotUsed.size() && count != 0; i++) {
+        if (this->slotUsed[i]) {
+            continue;
+        }
+        if (this->threads[i].joinable()) {
+            // The worker that retired from this slot is exiting, if it hasn't already
+            this->threads[i].join();
+        }
+        this->slotUsed[i] = true;
+        this->threadCount++;
+        this->growCount.fetch_add(1, std::memory_order_relaxed);
+        this->threads[i] = std::thread(worker, this, i);
+        count--;
+    }
+}
+
+/*
+Function:   retireWorker
+Desc:       For internal use only. Called when a worker has been parked for the elasticPolicy's idleTimeout.
+.           Stop it unless the pool is at minThreads or a job came in, its spare nodes are freed, its deque
+.           is left for the next worker in the slot
+Args:       index: The worker's slot
+Return:     Whether the worker should exit
+*/
+bool ThreadPool::retireWorker(size_t index) {
+    std::lock_guard<std::mutex> lock(this->workMutex);
+    workerInfo *self = this->workers[index].load(std::memory_order_relaxed);
+
+    // The worker no longer counts as a waiter, so it looks once more before it leaves
+    if (this->stop || this->threadCount <= this->elastic.minThreads || !this->looksEmpty(index)) {
+        return false;
+    }
+    while (self->freeNodes != NULL) {
+        jobNode *node = self->freeNodes;
+        self->freeNodes = node->next;
+        delete node;
+    }
+    self->freeCount = 0;
+    this->slotUsed[index] = false;
+    this->threadCount--;
+    this->retireCount.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void ThreadPool::trackQueueWait() {
+    std::lock_guard<std::mutex> lock(this->workMutex);
+    this->trackingWait = true;
+    // Before init, init starts it. An elastic pool has one already
+    if (this->startedCount != 0 && !this->stop && !this->monitorThread.joinable()) {
+        this->monitorThread = std::thread(&ThreadPool::monitor, this);
+    }
+}
+
+unsigned long long ThreadPool::estimateQueueWait() {
+    // The jobs queued right now, so that a burst counts before the next tick
+    size_t queued = this->queuedCount.load(std::memory_order_relaxed);
+    if (queued == 0) {
+        return 0;
+    }
+    double wait = std::max(queued * this->jobInterval.load(std::memory_order_relaxed),
+        this->stalledFor.load(std::memory_order_relaxed));
+    return (unsigned long long)std::min(wait, 1e18);
+}
+
+/*
+Function:   monitor
+Desc:       For internal use only. Runs on its own thread while the pool is elastic, or once trackQueueWait
+.           has been called. Every tick, estimate how long a new job waits: the queued jobs divided by the
+.           rate workers finish them while jobs are waiting, smoothed over a few ticks. While nothing
+.           finishes, the time since the last job finished. When the estimate is above the queueWaitTarget
+.           and no worker is idle, start more workers. Also join retired workers
+*/
+void ThreadPool::monitor() {
+    std::unique_lock<std::mutex> lock(this->workMutex);
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    unsigned long long lastDone = 0;
+    size_t lastQueued = 0;
+    double rate = 0;            // Jobs finished per microsecond
+    double stalled = 0;         // Microseconds since a job last finished while jobs were queued
+
+    while (!this->stop) {
+        this->monitorCond.wait_for(lock, std::chrono::milliseconds(this->elastic.tick == 0 ? 10 : this->elastic.tick));
+        if (this->stop) {
+            break;
+        }
+
+        for (size_t i = 0; i < this->slotUsed.size(); i++) {
+            if (!this->slotUsed[i] && this->threads[i].joinable()) {
+                this->threads[i].join();
             }
         }
-        this->jobQueue.pop();
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double, std::micro>(now - last).count();
+        unsigned long long done = 0;
+        for (std::atomic<workerInfo *> &slot : this->workers) {
+            workerInfo *info = slot.load(std::memory_order_relaxed);
+            if (info != NULL) {
+                done += info->jobsRun.load(std::memory_order_relaxed);
+            }
+        }
+
+        size_t queued = this->queuedCount.load();
+        if (elapsed > 0 && queued != 0 && lastQueued != 0) {
+            // Jobs were waiting all along, so the workers ran as fast as they could. While they are idle,
+            // the rate would only say how fast jobs come in
+            double current = (done - lastDone) / elapsed;
+            rate = rate == 0 ? current : rate * 0.75 + current * 0.25;
+        }
+        double wait = 0;
+        if (queued != 0) {
+            stalled = done == lastDone ? stalled + elapsed : 0;
+            wait = std::min(std::max(rate > 0 ? queued / rate : 0, stalled), 1e18);
+        }
+        else {
+            stalled = 0;
+        }
+        last = now;
+        lastDone = done;
+        lastQueued = queued;
+        this->queueWait.store((unsigned long long)wait, std::memory_order_relaxed);
+        this->jobInterval.store(rate > 0 ? 1 / rate : 0, std::memory_order_relaxed);
+        this->stalledFor.store(stalled, std::memory_order_relaxed);
+
+        size_t running = this->threadCount;
+        if (wait > this->elastic.queueWaitTarget && running < this->elastic.maxThreads &&
+            this->newJobEvent.waiters() == 0 && this->spinningCount.load() == 0) {
+            // Grow in proportion to how far the wait is over the target, at most doubling per tick
+            size_t target = this->elastic.queueWaitTarget == 0 ? 1 : this->elastic.queueWaitTarget;
+            size_t grow = (size_t)(wait / target);
+            grow = std::min(std::min(grow, running), std::min(queued, this->elastic.maxThreads - running));
+            this->spawnWorkers(std::max(grow, (size_t)1));
+        }
     }
+}
+
+void ThreadPool::shutdown(bool finishRemainingJobs) {
+    this->workMutex.lock();
+    if (this->stop) {
+        this->workMutex.unlock();
+        return;
+    }
+    this->discardJobs = !finishRemainingJobs;
     this->stop = true;
-    this->newJobCond.notify_all();  // There isn't really a "new job", this just unblocks the workers to allow them to exit
+    this->monitorCond.notify_all();
     this->workMutex.unlock();
+
+    // No more workers are started after this
+    if (this->monitorThread.joinable()) {
+        this->monitorThread.join();
+    }
+
+    // There isn't really a "new job", this just unblocks the workers to allow them to exit
+    this->newJobEvent.notifyAll();
+    this->newUrgentJobEvent.notifyAll();
+
+    // When finishing, the workers only exit once they find no job anywhere
+    for (auto &thread : this->threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    this->threads.clear();
+
+    // Whatever is left was queued after the workers gave up, or is being discarded
+    job currentJob;
+    while (this->findJob(0, currentJob)) {
+        if (finishRemainingJobs) {
+            this->runJob(currentJob);
+        }
+        else {
+            currentJob.reset();
+            this->queuedCount--;
+            this->finishJob();
+        }
+    }
+
+    for (std::atomic<workerInfo *> &slot : this->workers) {
+        workerInfo *info = slot.load();
+        if (info == NULL) {
+            continue;
+        }
+        while (info->freeNodes != NULL) {
+            jobNode *node = info->freeNodes;
+            info->freeNodes = node->next;
+            delete node;
+        }
+        delete info;
+        slot.store(NULL);
+    }
+    this->workers.clear();
+
+    std::lock_guard<std::mutex> lock(this->workMutex);
+    this->noJobCond.notify_all();
 }
 
-bool ThreadPool::addJob(job newJob) {
-    this->workMutex.lock();
+bool ThreadPool::addJob(job newJob, jobPriority priority) {
+    if (this->stop || priority < PRIORITY_HIGH || priority >= PRIORITY_COUNT) {
+        return false;
+    }
 
-    // Check for maximum queue size. 0 means no limitation
-    if (maxJobCount == 0 || this->jobQueue.size() < maxJobCount) {
-        this->jobQueue.push(newJob);
-        this->newJobCond.notify_all();
-        this->workMutex.unlock();
-        return true;
+    // Check for maximum queue size of the lane. 0 means no limitation
+    jobLane &lane = this->lanes[priority];
+    if (lane.queued.fetch_add(1) >= lane.maxJobCount && lane.maxJobCount != 0) {
+        lane.queued--;
+        return false;
+    }
+    this->queuedCount++;
+    this->unfinishedCount++;
+
+    workerInfo *self = currentPool == this ? this->workers[currentIndex].load(std::memory_order_relaxed) : NULL;
+    if (priority == PRIORITY_NORMAL && self != NULL && !self->reserved) {
+        // Submitted by one of our workers, keep it local. Idle workers will steal it
+        self->deque.push(this->allocNode(self, std::move(newJob)));
+    }
+    else if (lane.bounded != NULL) {
+        // Lock-free. The lane's queued count is below its maxJobCount, so the ring has room
+        if (!lane.bounded->push(newJob)) {
+            this->queuedCount--;
+            lane.queued--;
+            this->finishJob();
+            return false;
+        }
     }
     else {
-        this->workMutex.unlock();
-        return false;
+        std::lock_guard<std::mutex> lock(lane.mutex);
+        this->pushShared(lane, std::move(newJob));
+    }
+
+    // Wake up one parked worker, if any
+    this->wakeWorker(priority);
+    return true;
+}
+
+void ThreadPool::setLaneLimit(jobPriority priority, size_t maxJobCount) {
+    if (priority >= PRIORITY_HIGH && priority < PRIORITY_COUNT) {
+        this->lanes[priority].maxJobCount = maxJobCount;
+        this->lanes[priority].hasLimit = true;
+    }
+}
+
+void ThreadPool::setReservedWorkers(size_t count) {
+    this->reservedCount = count;
+}
+
+void ThreadPool::setElasticPolicy(const elasticPolicy &policy) {
+    this->elastic = policy;
+}
+
+void ThreadPool::setIdlePolicy(const idlePolicy &policy) {
+    this->spinLimit = policy.spinCount;
+    this->yieldLimit = policy.yieldCount;
+}
+
+poolStats ThreadPool::getStats() {
+    poolStats stats = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    for (std::atomic<workerInfo *> &slot : this->workers) {
+        workerInfo *info = slot.load(std::memory_order_acquire);
+        if (info == NULL) {
+            continue;
+        }
+        stats.steals += info->steals.load(std::memory_order_relaxed);
+        stats.remoteSteals += info->remoteSteals.load(std::memory_order_relaxed);
+        stats.spins += info->spins.load(std::memory_order_relaxed);
+        stats.yields += info->yields.load(std::memory_order_relaxed);
+        stats.spinHits += info->spinHits.load(std::memory_order_relaxed);
+        stats.parks += info->parks.load(std::memory_order_relaxed);
+    }
+    stats.wakeups = this->wakeupCount.load(std::memory_order_relaxed);
+    stats.threads = this->threadCount.load(std::memory_order_relaxed);
+    stats.grows = this->growCount.load(std::memory_order_relaxed);
+    stats.retires = this->retireCount.load(std::memory_order_relaxed);
+    stats.queueWait = this->queueWait.load(std::memory_order_relaxed);
+    return stats;
+}
+
+/*
+Function:   wakeWorker
+Desc:       For internal use only. Called after a job is queued. Wake up a parked worker that can run it,
+.           unless an idle one is still spinning: it will find the job without a futex wake and a
+.           context switch. A PRIORITY_HIGH job goes to a reserved worker first
+Args:       priority: The lane of the job
+*/
+void ThreadPool::wakeWorker(jobPriority priority) {
+    // Pairs with the worker's spinning count decrement before it parks: either it sees the job,
+    // or this sees it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (priority == PRIORITY_HIGH && this->reservedCount != 0) {
+        if (this->reservedSpinningCount.load(std::memory_order_seq_cst) != 0) {
+            return;
+        }
+        if (this->newUrgentJobEvent.notify()) {
+            this->wakeupCount.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    if (this->spinningCount.load(std::memory_order_seq_cst) != 0) {
+        return;
+    }
+    if (this->newJobEvent.notify()) {
+        this->wakeupCount.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
@@ -66,7 +943,7 @@ void ThreadPool::waitForAllJobsDone() {
     std::unique_lock<std::mutex> lock(this->workMutex);
     for (;;) {
         // Wait until no working threads and the queue is empty
-        if (this->workingCount != 0 || !this->jobQueue.empty()) {
+        if (this->unfinishedCount != 0) {
             this->noJobCond.wait(lock);
         }
         else {
@@ -76,40 +953,511 @@ void ThreadPool::waitForAllJobsDone() {
     lock.unlock();
 }
 
-void worker(ThreadPool *pool) {
-    for (;;) {
-        std::unique_lock<std::mutex> lock(pool->workMutex);
+/*
+Function:   pushShared
+Desc:       Add a job to the ring of a lane, doubling it when full. The lane's mutex must be held
+Args:       lane: The lane
+.           newJob: The job
+*/
+void ThreadPool::pushShared(jobLane &lane, job &&newJob) {
+    size_t capacity = lane.ring.size();
+    if (lane.length == capacity) {
+        // Full, unroll the ring into a bigger one
+        std::vector<job> bigger(capacity == 0 ? SHARED_QUEUE_INITIAL : capacity * 2);
+        for (size_t i = 0; i < lane.length; i++) {
+            bigger[i] = std::move(lane.ring[(lane.head + i) % capacity]);
+        }
+        lane.ring.swap(bigger);
+        lane.head = 0;
+        capacity = lane.ring.size();
+    }
+    lane.ring[(lane.head + lane.length) % capacity] = std::move(newJob);
+    lane.length++;
+}
+
+/*
+Function:   popShared
+Desc:       Take the oldest job from the ring of a lane. The lane's mutex must be held and the ring must
+.           not be empty
+Args:       lane: The lane
+Return:     The job
+*/
+job ThreadPool::popShared(jobLane &lane) {
+    job oldest = std::move(lane.ring[lane.head]);
+    lane.head = (lane.head + 1) % lane.ring.size();
+    lane.length--;
+    return oldest;
+}
+
+/*
+Function:   takeShared
+Desc:       Take a job from the shared queue of a lane. From the PRIORITY_NORMAL lane, a worker also moves
+.           a batch of the next ones into its own deque, so they need no further trip to the shared queue
+.           and can be stolen
+Args:       priority: The lane
+.           self: The worker, NULL if it's not a worker
+.           found: Receives the job
+Return:     Whether a job was taken
+*/
+bool ThreadPool::takeShared(jobPriority priority, workerInfo *self, job &found) {
+    jobLane &lane = this->lanes[priority];
+    workerInfo *batchTo = priority == PRIORITY_NORMAL && self != NULL && !self->reserved ? self : NULL;
+    size_t count = std::max(this->threadCount.load(std::memory_order_relaxed), (size_t)1);
+    size_t left;
+
+    if (lane.queued.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    if (lane.bounded != NULL) {
+        if (!lane.bounded->pop(found)) {
+            return false;
+        }
+        if (batchTo != NULL) {
+            size_t batch = lane.bounded->size() / count;
+            job next;
+            for (size_t i = 0; i < batch && i < INJECT_BATCH && lane.bounded->pop(next); i++) {
+                batchTo->deque.push(this->allocNode(batchTo, std::move(next)));
+            }
+        }
+        left = lane.bounded->size();
+    }
+    else {
+        std::lock_guard<std::mutex> lock(lane.mutex);
+        if (lane.length == 0) {
+            return false;
+        }
+        found = this->popShared(lane);
+        if (batchTo != NULL) {
+            size_t batch = lane.length / count;
+            for (size_t i = 0; i < batch && i < INJECT_BATCH; i++) {
+                batchTo->deque.push(this->allocNode(batchTo, this->popShared(lane)));
+            }
+        }
+        left = lane.length;
+    }
+    lane.queued--;
 
-        // Wait for a new job or the stop signal
-        while (pool->jobQueue.empty() && !pool->stop) {
-            pool->newJobCond.wait(lock);
+    if (left != 0 || (batchTo != NULL && !batchTo->deque.empty())) {
+        // There's more, get another worker going. It will wake the next one if needed
+        this->wakeWorker(priority);
+    }
+    return true;
+}
+
+/*
+Function:   looksEmpty
+Desc:       For internal use only. Check every queue the worker takes jobs from. Used right before it parks
+Args:       index: The worker
+Return:     Whether all of them looked empty
+*/
+bool ThreadPool::looksEmpty(size_t index) {
+    if (this->workers[index].load(std::memory_order_relaxed)->reserved) {
+        return this->lanes[PRIORITY_HIGH].queued.load() == 0;
+    }
+    for (jobLane &lane : this->lanes) {
+        if (lane.queued.load() != 0) {
+            return false;
+        }
+    }
+    for (std::atomic<workerInfo *> &slot : this->workers) {
+        workerInfo *info = slot.load(std::memory_order_acquire);
+        if (info != NULL && !info->deque.empty()) {
+            return false;
         }
-        
-        // Stop signal caught, exit the thread
+    }
+    return true;
+}
+
+/*
+Function:   allocNode
+Desc:       Wrap a job in a node for a worker's deque, reusing a spare node when there is one
+Args:       self: The worker
+.           newJob: The job
+Return:     The node
+*/
+jobNode *ThreadPool::allocNode(workerInfo *self, job &&newJob) {
+    jobNode *node = self->freeNodes;
+    if (node != NULL) {
+        self->freeNodes = node->next;
+        self->freeCount--;
+    }
+    else {
+        node = new jobNode;
+    }
+    node->work = std::move(newJob);
+    return node;
+}
+
+/*
+Function:   releaseNode
+Desc:       Take the job out of a node and keep the node as a spare of the worker, or free it
+Args:       self: The worker that took the node, NULL if it's not a worker
+.           node: The node
+.           found: Receives the job
+*/
+void ThreadPool::releaseNode(workerInfo *self, jobNode *node, job &found) {
+    found = std::move(node->work);
+    if (self != NULL && self->freeCount < NODE_CACHE_MAX) {
+        node->next = self->freeNodes;
+        self->freeNodes = node;
+        self->freeCount++;
+    }
+    else {
+        delete node;
+    }
+}
+
+/*
+Function:   findJob
+Desc:       For internal use only. Look for a job in the PRIORITY_HIGH lane, then in the worker's own deque,
+.           the PRIORITY_NORMAL lane and the other workers' deques, then in the PRIORITY_LOW lane.
+.           A reserved worker only looks in the PRIORITY_HIGH lane
+Args:       index: The worker looking for a job
+.           found: Receives the job
+Return:     Whether a job was taken out of its queue
+*/
+bool ThreadPool::findJob(size_t index, job &found) {
+    size_t count = this->workers.size();
+    bool isWorker = currentPool == this;
+    workerInfo *self = isWorker ? this->workers[index].load(std::memory_order_relaxed) : NULL;
+    jobLane &normal = this->lanes[PRIORITY_NORMAL];
+    jobNode *node;
+
+    if (this->takeShared(PRIORITY_HIGH, self, found)) {
+        return true;
+    }
+    if (self != NULL && self->reserved) {
+        return false;
+    }
+
+    if (isWorker && (node = self->deque.pop()) != NULL) {
+        this->releaseNode(self, node, found);
+        normal.queued--;
+        return true;
+    }
+
+    if (this->takeShared(PRIORITY_NORMAL, self, found)) {
+        return true;
+    }
+
+    // Steal, starting at a random victim. Victims on the worker's own NUMA node first, their jobs and
+    // the data those point to are more likely to be in local memory and the shared cache
+    size_t start = 0;
+    if (isWorker) {
+        self->seed = self->seed * 1103515245u + 12345u;
+        start = (self->seed >> 16) % count;
+    }
+    for (int pass = 0; pass < (this->multiNode ? 2 : 1); pass++) {
+        for (size_t i = 0; i < count && normal.queued.load(std::memory_order_relaxed) != 0; i++) {
+            size_t victim = (start + i) % count;
+            workerInfo *other = this->workers[victim].load(std::memory_order_acquire);
+            if (other == NULL) {
+                continue;
+            }
+            bool remote = isWorker && this->multiNode && other->node != self->node;
+            if ((victim == index && isWorker) || other->reserved || remote != (pass == 1)) {
+                continue;
+            }
+            if ((node = other->deque.steal()) != NULL) {
+                this->releaseNode(self, node, found);
+                normal.queued--;
+                if (isWorker) {
+                    self->steals.fetch_add(1, std::memory_order_relaxed);
+                    if (remote) {
+                        self->remoteSteals.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                if (!other->deque.empty()) {
+                    this->wakeWorker(PRIORITY_NORMAL);
+                }
+                return true;
+            }
+        }
+    }
+
+    return this->takeShared(PRIORITY_LOW, self, found);
+}
+
+/*
+Function:   runJob
+Desc:       For internal use only. Run a job taken from a queue and destroy it
+Args:       currentJob: The job
+*/
+void ThreadPool::runJob(job &currentJob) {
+    this->queuedCount--;
+    this->workingCount++;
+    if (currentJob) {
+        currentJob();
+    }
+    currentJob.reset();
+    this->workingCount--;
+    this->finishJob();
+}
+
+/*
+Function:   finishJob
+Desc:       For internal use only. Called once for every job counted in unfinishedCount, when it has run,
+.           has been discarded, or could not be queued after all
+*/
+void ThreadPool::finishJob() {
+    if (--this->unfinishedCount == 0) {
+        // Notify there's no job working
+        std::lock_guard<std::mutex> lock(this->workMutex);
+        this->noJobCond.notify_all();
+    }
+}
+
+/*
+Function:   spinForJob
+Desc:       For internal use only. Wait for a job as set by setIdlePolicy: spin with a CPU pause, then
+.           yield. The queues are only searched when a queued count says there's a job for the worker
+Args:       index: The worker
+.           found: Receives the job
+Return:     Whether a job was found
+*/
+bool ThreadPool::spinForJob(size_t index, job &found) {
+    workerInfo *self = this->workers[index].load(std::memory_order_relaxed);
+    std::atomic<size_t> &spinning = self->reserved ? this->reservedSpinningCount : this->spinningCount;
+    std::atomic<size_t> &queued = self->reserved ? this->lanes[PRIORITY_HIGH].queued : this->queuedCount;
+    unsigned spins = this->spinLimit.load(std::memory_order_relaxed);
+    unsigned yields = this->yieldLimit.load(std::memory_order_relaxed);
+    unsigned long long spun = 0, yielded = 0;
+    bool got = false;
+
+    spinning++;
+    for (unsigned i = 0; i < spins + yields && !this->stop; i++) {
+        if (i < spins) {
+            cpuRelax();
+            spun++;
+        }
+        else {
+            std::this_thread::yield();
+            yielded++;
+        }
+        if (queued.load(std::memory_order_relaxed) != 0) {
+            // Not spinning while we search, so wakeWorker gets another worker going if there's more
+            spinning--;
+            got = this->findJob(index, found);
+            if (got) {
+                break;
+            }
+            spinning++;
+        }
+    }
+    if (!got) {
+        spinning--;
+    }
+
+    self->spins.fetch_add(spun, std::memory_order_relaxed);
+    self->yields.fetch_add(yielded, std::memory_order_relaxed);
+    if (got) {
+        self->spinHits.fetch_add(1, std::memory_order_relaxed);
+    }
+    return got;
+}
+
+/*
+Function:   waitForZero
+Desc:       Wait until a count of unfinished work reaches 0: spin for a while, the work left is usually
+.           short, then sleep on an event count that whoever brings the count to 0 notifies
+Args:       count: The count
+.           done: The event count
+*/
+static void waitForZero(std::atomic<size_t> &count, EventCount &done) {
+    for (unsigned i = 0; count.load() != 0; i++) {
+        if (i < 64) {
+            cpuRelax();
+            continue;
+        }
+        unsigned key = done.prepareWait();
+        if (count.load() != 0) {
+            done.commitWait(key);
+        }
+        else {
+            done.cancelWait(key);
+        }
+    }
+}
+
+size_t ThreadPool::chunkSize(size_t count, size_t grain) {
+    if (grain != 0) {
+        return grain;
+    }
+    size_t chunks = std::max(this->threadCount.load(std::memory_order_relaxed), (size_t)1) * 4;
+    return std::max(count / chunks, (size_t)1);
+}
+
+/*
+Function:   forkJoin
+Desc:       Run chunks [0, chunks) on the calling thread and idle workers. One job per worker is queued to
+.           help, each one takes chunks until none is left, and so does the caller. Then the caller waits
+.           for the chunks still running elsewhere. Helpers that only start afterwards find nothing to do
+Args:       chunks: Number of chunks
+.           runChunk: Runs one chunk
+.           context: Passed to runChunk
+*/
+void ThreadPool::forkJoin(size_t chunks, void (*runChunk)(void *context, size_t chunk), void *context) {
+    std::shared_ptr<forkJoinState> state = std::make_shared<forkJoinState>();
+    state->chunks = chunks;
+    state->runChunk = runChunk;
+    state->context = context;
+
+    size_t helpers = std::min(chunks - 1, this->threadCount.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < helpers; i++) {
+        if (!this->addJob([state] { ThreadPool::runChunks(*state); })) {
+            // The lane is full, the others will do
+            break;
+        }
+    }
+    ThreadPool::runChunks(*state);
+    waitForZero(state->active, state->done);
+
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
+
+/*
+Function:   runChunks
+Desc:       For internal use only. Take chunks one at a time and run them until none is left. After an
+.           exception, the chunks not started yet are skipped
+Args:       state: The fork-join
+*/
+void ThreadPool::runChunks(forkJoinState &state) {
+    // Counted before taking a chunk, so the caller never sees no one active while a chunk is running
+    state.active++;
+    for (size_t chunk; (chunk = state.next.fetch_add(1)) < state.chunks; ) {
+        try {
+            state.runChunk(state.context, chunk);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(state.errorMutex);
+            if (!state.error) {
+                state.error = std::current_exception();
+            }
+            state.next.store(state.chunks);
+        }
+    }
+    if (state.active.fetch_sub(1) == 1) {
+        state.done.notifyAll();
+    }
+}
+
+TaskGroup::TaskGroup(ThreadPool &pool) : pool(pool), state(std::make_shared<groupState>()) {
+}
+
+TaskGroup::~TaskGroup() {
+    try {
+        this->wait();
+    }
+    catch (...) {
+    }
+}
+
+/*
+Function:   submit
+Desc:       Queue a task on the pool. If the pool doesn't take it, wait() runs it
+Args:       work: The task
+*/
+void TaskGroup::submit(job &&work) {
+    std::shared_ptr<task> newTask = std::make_shared<task>();
+    std::shared_ptr<groupState> shared = this->state;
+
+    newTask->work = std::move(work);
+    this->state->pending++;
+    this->tasks.push_back(newTask);
+    this->pool.addJob([shared, newTask] { TaskGroup::execute(*shared, *newTask); });
+}
+
+/*
+Function:   execute
+Desc:       Run a task unless another thread has started it already
+Args:       state: The group's state
+.           work: The task
+*/
+void TaskGroup::execute(groupState &state, task &work) {
+    if (work.claimed.exchange(true)) {
+        return;
+    }
+    try {
+        work.work();
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> lock(state.errorMutex);
+        if (!state.error) {
+            state.error = std::current_exception();
+        }
+    }
+    work.work.reset();
+    if (state.pending.fetch_sub(1) == 1) {
+        state.done.notifyAll();
+    }
+}
+
+void TaskGroup::wait() {
+    // The newest tasks are the least likely to have been picked up
+    for (size_t i = this->tasks.size(); i > 0; i--) {
+        TaskGroup::execute(*this->state, *this->tasks[i - 1]);
+    }
+    waitForZero(this->state->pending, this->state->done);
+    this->tasks.clear();
+
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(this->state->errorMutex);
+        error = this->state->error;
+        this->state->error = NULL;
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void worker(ThreadPool *pool, size_t index) {
+    workerInfo *self = pool->startWorker(index);
+    EventCount &newJobEvent = self->reserved ? pool->newUrgentJobEvent : pool->newJobEvent;
+    currentPool = pool;
+    currentIndex = index;
+
+    // Reserved workers are never stopped, see setElasticPolicy
+    bool elastic = pool->elastic.maxThreads > pool->elastic.minThreads && !self->reserved;
+    unsigned idleTimeout = elastic ? std::max(pool->elastic.idleTimeout, 1u) : 0;
+
+    job currentJob;
+    for (;;) {
+        if (!(pool->stop && pool->discardJobs) && pool->findJob(index, currentJob)) {
+            pool->runJob(currentJob);
+            self->jobsRun.store(self->jobsRun.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            continue;
+        }
+
+        // Stop signal caught and nothing left to do, exit the thread
         if (pool->stop) {
             pool->threadCount--;
-            pool->noJobCond.notify_one();
-            lock.unlock();
+            currentPool = NULL;
             return;
         }
 
-        // Obtain a job from the queue and start working!
-        job currentJob = pool->jobQueue.front();
-        pool->jobQueue.pop();
-        pool->workingCount++;
-        lock.unlock();
-
-        if (currentJob.func) {
-            currentJob.func(currentJob.args);
+        // Out of jobs. Spin for a while, a new one is likely to come soon
+        if (!pool->discardJobs && pool->spinForJob(index, currentJob)) {
+            pool->runJob(currentJob);
+            self->jobsRun.store(self->jobsRun.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            continue;
         }
 
-        // Job finished
-        lock.lock();
-        pool->workingCount--;
-        if (pool->jobQueue.empty() && !pool->stop && pool->workingCount == 0) {
-            // Notify there's no job working
-            pool->noJobCond.notify_one();
+        // Park. Announce it first, then look once more: a job added in between is either
+        // seen here or its producer sees the waiter and wakes it up
+        unsigned key = newJobEvent.prepareWait();
+        if (pool->looksEmpty(index) && !pool->stop) {
+            self->parks.fetch_add(1, std::memory_order_relaxed);
+            if (!newJobEvent.commitWait(key, idleTimeout) && pool->retireWorker(index)) {
+                // Idle for too long, the pool has more workers than it needs
+                currentPool = NULL;
+                return;
+            }
+        }
+        else {
+            newJobEvent.cancelWait(key);
         }
-        lock.unlock();
     }
 }
@@ -5,44 +5,435 @@ Desc:   Define types and function prototypes of the thread pool
 Note:   Huge thanks to https://nachtimwald.com/2019/04/12/thread-pool-in-c/
 */
 
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
 #include <thread>
 #include <functional>
-#include <queue>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <exception>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+// Bytes of captures a job holds without allocating. Bigger callables are moved to the heap
+#ifndef JOB_INLINE_SIZE
+#define JOB_INLINE_SIZE 48
+#endif
 
+/*
+Class:  job
+Desc:   A move-only callable. Callables up to JOB_INLINE_SIZE bytes are stored inside the job
+.       itself, so creating and queueing one does not allocate.
+.       E.g. addJob([param] { handleCalc(param); });
+.       or, as before, addJob(job(handler, args)); which calls handler(args)
+*/
 class job {
 public:
-    job(std::function<void(void *)> func, void *args);
-    std::function<void (void *)> func;
-    void *args;
+    job() noexcept : ops(NULL) {}
+
+    template <typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, job>::value>::type>
+    job(F &&callable) : ops(NULL) {
+        this->store(std::forward<F>(callable));
+    }
+
+    template <typename F>
+    job(F &&func, void *args) : ops(NULL) {
+        typename std::decay<F>::type target(std::forward<F>(func));
+        this->store([target, args]() mutable { target(args); });
+    }
+
+    job(job &&other) noexcept : ops(NULL) {
+        this->moveFrom(other);
+    }
+
+    job &operator=(job &&other) noexcept {
+        if (this != &other) {
+            this->reset();
+            this->moveFrom(other);
+        }
+        return *this;
+    }
+
+    job(const job &) = delete;
+    job &operator=(const job &) = delete;
+
+    ~job() {
+        this->reset();
+    }
+
+    // Run the callable. The job must not be empty
+    void operator()() {
+        this->ops->call(this->storage);
+    }
+
+    // Whether the job holds a callable
+    explicit operator bool() const {
+        return this->ops != NULL;
+    }
+
+    // Destroy the callable, leaving the job empty
+    void reset() noexcept {
+        if (this->ops != NULL) {
+            this->ops->destroy(this->storage);
+            this->ops = NULL;
+        }
+    }
+
+private:
+    // How to call, move and destroy the stored callable
+    struct operations {
+        void (*call)(void *storage);
+        void (*move)(void *to, void *from);     // Move into empty storage, destroying the source
+        void (*destroy)(void *storage);
+    };
+
+    // Callables stored in place
+    template <typename T>
+    struct inlineOps {
+        static void call(void *storage) { (*static_cast<T *>(storage))(); }
+        static void move(void *to, void *from) {
+            new (to) T(std::move(*static_cast<T *>(from)));
+            static_cast<T *>(from)->~T();
+        }
+        static void destroy(void *storage) { static_cast<T *>(storage)->~T(); }
+        static const operations table;
+    };
+
+    // Callables too big, or not safe to move, stored on the heap
+    template <typename T>
+    struct heapOps {
+        static void call(void *storage) { (**static_cast<T **>(storage))(); }
+        static void move(void *to, void *from) { *static_cast<T **>(to) = *static_cast<T **>(from); }
+        static void destroy(void *storage) { delete *static_cast<T **>(storage); }
+        static const operations table;
+    };
+
+    alignas(std::max_align_t) unsigned char storage[JOB_INLINE_SIZE];
+    const operations *ops;
+
+    template <typename F>
+    void store(F &&callable) {
+        typedef typename std::decay<F>::type T;
+        if (sizeof(T) <= JOB_INLINE_SIZE && alignof(T) <= alignof(std::max_align_t) &&
+            std::is_nothrow_move_constructible<T>::value) {
+            new (this->storage) T(std::forward<F>(callable));
+            this->ops = &inlineOps<T>::table;
+        }
+        else {
+            *reinterpret_cast<T **>(this->storage) = new T(std::forward<F>(callable));
+            this->ops = &heapOps<T>::table;
+        }
+    }
+
+    void moveFrom(job &other) noexcept {
+        if (other.ops != NULL) {
+            other.ops->move(this->storage, other.storage);
+            this->ops = other.ops;
+            other.ops = NULL;
+        }
+    }
+};
+
+template <typename T>
+const job::operations job::inlineOps<T>::table = { &job::inlineOps<T>::call, &job::inlineOps<T>::move, &job::inlineOps<T>::destroy };
+
+template <typename T>
+const job::operations job::heapOps<T>::table = { &job::heapOps<T>::call, &job::heapOps<T>::move, &job::heapOps<T>::destroy };
+
+// For internal use only. A job waiting in a worker's deque. Nodes are recycled, see workerInfo
+typedef struct _jobNode {
+    job             work;
+    struct _jobNode *next;      // Linkage in workerInfo::freeNodes
+} jobNode;
+
+/*
+Class:  WorkStealingDeque
+Desc:   Chase-Lev work-stealing deque. The owner pushes and pops at the bottom without locking,
+.       any other thread steals from the top. It grows when it runs full
+Note:   "Correct and Efficient Work-Stealing for Weak Memory Models", Le et al., PPoPP 2013
+*/
+class WorkStealingDeque {
+public:
+    WorkStealingDeque(size_t capacity = 256);
+    ~WorkStealingDeque();
+
+    // Owner only. Add an element at the bottom
+    void push(jobNode *item);
+
+    // Owner only. Take the element at the bottom, NULL if empty
+    jobNode *pop();
+
+    // Any thread. Take the element at the top, NULL if empty or lost a race
+    jobNode *steal();
+
+    // Any thread. Whether the deque looks empty. May be out of date by the time it returns
+    bool empty() const;
+
+private:
+    struct ring {
+        size_t              mask;       // Capacity - 1, the capacity is a power of 2
+        std::atomic<jobNode *> *items;
+    };
+    std::atomic<long long>  top;
+    std::atomic<long long>  bottom;
+    std::atomic<ring *>     array;
+    std::vector<ring *>     retired;    // Outgrown rings, thieves may still read them
+
+    ring *grow(ring *old, long long top, long long bottom);
+};
+
+/*
+Class:  BoundedJobQueue
+Desc:   Bounded lock-free multi-producer multi-consumer ring of jobs. Every slot carries a sequence
+.       number that tells producers and consumers whose turn it is, so neither side ever waits for
+.       the other, and a full or empty ring is detected with a single load
+Note:   Dmitry Vyukov's bounded MPMC queue
+*/
+class BoundedJobQueue {
+public:
+    BoundedJobQueue(size_t capacity);
+    ~BoundedJobQueue();
+
+    // Any thread. Add a job, false if the ring is full. The job is left untouched then
+    bool push(job &newJob);
+
+    // Any thread. Take the oldest job, false if the ring is empty
+    bool pop(job &found);
+
+    // Any thread. Number of jobs in the ring. May be out of date by the time it returns
+    size_t size() const;
+
+private:
+    struct slot {
+        std::atomic<size_t> sequence;
+        job                 work;
+    };
+    slot                    *slots;
+    size_t                  mask;           // Capacity - 1, the capacity is a power of 2
+    alignas(64) std::atomic<size_t> head;   // Next slot to pop, on its own cache line
+    alignas(64) std::atomic<size_t> tail;   // Next slot to push
+};
+
+/*
+Class:  EventCount
+Desc:   Lets workers sleep until a job arrives without producers taking a lock. A worker announces
+.       itself with prepareWait, checks the queues once more, then either sleeps with commitWait
+.       or gives up with cancelWait. A notification claims one announced worker, so a worker that
+.       has been woken but hasn't run yet doesn't draw more wakeups. notify costs one atomic load
+.       while nobody is waiting
+Note:   Sleeps on a futex on Linux, on a condition variable elsewhere
+*/
+class EventCount {
+public:
+    // Announce that the caller is about to sleep. Returns the key to pass to commitWait or cancelWait
+    unsigned prepareWait();
+
+    // Sleep until notified, unless a notification came in since prepareWait. With a timeout in
+    // milliseconds, give up after it and return false, 0 waits forever
+    bool commitWait(unsigned key, unsigned timeout = 0);
+
+    // Don't sleep after all. False if a notification claimed the caller meanwhile
+    bool cancelWait(unsigned key);
+
+    // Wake up one / all sleeping threads, if any. Return whether there was one
+    bool notify();
+    bool notifyAll();
+
+    // Number of threads announced and not notified yet
+    size_t waiters() const;
+
+private:
+    // Announced waiters in the high half, the epoch in the low half. Every notification
+    // that claims a waiter starts a new epoch. On Linux, the futex is the low half
+    std::atomic<unsigned long long> state{0};
+#if !defined(__linux__)
+    std::mutex              mutex;
+    std::condition_variable cond;
+#endif
+    bool wake(bool all);
 };
 
+// How a worker waits for a job once it runs out of them. It checks the queues spinCount times with a
+// CPU pause in between, then yieldCount times giving up its time slice in between, then parks.
+// Spinning answers a new job within a fraction of a microsecond but burns the core meanwhile
+typedef struct _idlePolicy {
+    unsigned    spinCount;      // Default is 64
+    unsigned    yieldCount;     // Default is 8. Both 0 parks right away
+} idlePolicy;
+
+// Counters of the idle strategy, see ThreadPool::getStats
+typedef struct _poolStats {
+    unsigned long long  spins;      // Pauses spent spinning while idle
+    unsigned long long  yields;     // Time slices given up while idle
+    unsigned long long  spinHits;   // Jobs found while spinning or yielding, without parking
+    unsigned long long  parks;      // Times a worker went to sleep
+    unsigned long long  wakeups;    // Times a sleeping worker was woken up for a job
+    unsigned long long  steals;     // Jobs taken from another worker's deque
+    unsigned long long  remoteSteals;   // The same, from a worker on another NUMA node
+    unsigned long long  threads;    // Workers running now
+    unsigned long long  grows;      // Workers started because jobs waited too long, see elasticPolicy
+    unsigned long long  retires;    // Workers stopped after being idle for too long
+    unsigned long long  queueWait;  // Estimated time a new job waits in the queue, in microseconds
+} poolStats;
+
+// How the pool grows and shrinks with the load, see ThreadPool::setElasticPolicy. Every tick, the
+// queue wait is estimated from the number of queued jobs and the rate workers finish them. While it
+// is above queueWaitTarget and no worker is idle, more workers are started. A worker parked for
+// idleTimeout stops, down to minThreads. Jobs that block on I/O stop finishing, so the pool grows
+typedef struct _elasticPolicy {
+    size_t      minThreads;         // Workers never stopped
+    size_t      maxThreads;         // Most workers. Equal to minThreads keeps the size fixed
+    unsigned    queueWaitTarget;    // In microseconds. Default is 10000
+    unsigned    idleTimeout;        // In milliseconds. Default is 30000
+    unsigned    tick;               // How often the load is checked, in milliseconds. Default is 10
+} elasticPolicy;
+
+// Priority lanes of the thread pool, see ThreadPool::addJob. A worker always takes the job from the
+// highest lane that has one, so a burst of bulk work never delays latency-critical jobs behind it
+typedef enum _jobPriority {
+    PRIORITY_HIGH = 0,      // Latency-critical, e.g. interactive endpoints. Reserved workers only run these
+    PRIORITY_NORMAL,        // Default
+    PRIORITY_LOW,           // Bulk work, run when nothing else is queued
+    PRIORITY_COUNT
+} jobPriority;
+
+// Where threads are placed, see ThreadPool::init and RESTserver::startServer. Linux only, elsewhere
+// threads are never pinned
+typedef enum _affinityMode {
+    AFFINITY_NONE = 0,      // Let the OS place and move threads. Default
+    AFFINITY_COMPACT,       // Fill one NUMA node after the other, hyper-thread siblings next to each other
+    AFFINITY_SCATTER,       // Round-robin over the NUMA nodes, one thread per physical core before any sibling
+    AFFINITY_CPUS,          // Thread i runs on cpus[i % cpus.size()]
+    AFFINITY_NODE           // All threads run on the CPUs of NUMA node `node`
+} affinityMode;
+
+// A pinned thread allocates its own state after it has been pinned, so the kernel places that memory
+// on the thread's NUMA node
+typedef struct _affinityPolicy {
+    affinityMode        mode = AFFINITY_NONE;
+    std::vector<int>    cpus;           // For AFFINITY_CPUS
+    int                 node = 0;       // For AFFINITY_NODE
+} affinityPolicy;
+
+/*
+Function:   pinThread
+Desc:       Pin the calling thread as the index-th thread placed by an affinity policy. Only the CPUs the
+.           process may run on are used
+Args:       policy: See affinityPolicy
+.           index: The thread's position, e.g. the worker index
+Return:     The NUMA node the thread is pinned to, -1 if it isn't pinned
+*/
+int pinThread(const affinityPolicy &policy, size_t index);
+
+// For internal use only. A worker thread's own state
+typedef struct _workerInfo {
+    WorkStealingDeque   deque;          // PRIORITY_NORMAL jobs submitted from this worker, stolen by idle ones
+    unsigned            seed;           // Picks the victims to steal from
+    jobNode             *freeNodes;     // Spare nodes for the deque
+    size_t              freeCount;      // Length of freeNodes
+    bool                reserved;       // Only runs PRIORITY_HIGH jobs, see setReservedWorkers
+    int                 node;           // NUMA node the worker is pinned to, -1 if it isn't
+    std::atomic<unsigned long long> spins{0}, yields{0}, spinHits{0}, parks{0};    // See poolStats
+    std::atomic<unsigned long long> steals{0}, remoteSteals{0};
+    std::atomic<unsigned long long> jobsRun{0};     // Only written by the worker itself
+} workerInfo;
+
+// For internal use only. The shared queue of one priority lane
+typedef struct _jobLane {
+    std::mutex          mutex;                  // Guards ring
+    std::vector<job>    ring;                   // Jobs submitted from outside the pool, if unbounded
+    size_t              head = 0;               // Oldest job in ring
+    size_t              length = 0;             // Number of jobs in ring
+    BoundedJobQueue     *bounded = NULL;        // Lock-free ring used instead of ring, if bounded
+    std::atomic<size_t> queued{0};              // Jobs of this lane waiting in any queue
+    size_t              maxJobCount = 0;        // 0 means no limitation
+    bool                hasLimit = false;       // maxJobCount was set with setLaneLimit
+} jobLane;
+
+// For internal use only. Shared by the caller of parallelFor / parallelReduce and the jobs helping it. A job
+// that starts after the caller has returned finds no chunk left and never touches the caller's data
+typedef struct _forkJoinState {
+    std::atomic<size_t> next{0};        // Next chunk to run
+    size_t              chunks = 0;
+    std::atomic<size_t> active{0};      // Threads running chunks
+    void                (*runChunk)(void *context, size_t chunk) = NULL;
+    void                *context = NULL;
+    std::mutex          errorMutex;
+    std::exception_ptr  error;          // First exception thrown by a chunk, guarded by errorMutex
+    EventCount          done;           // The caller waits here for active to reach 0
+} forkJoinState;
+
 class ThreadPool {
 public:
-    std::mutex              workMutex;
-    std::condition_variable newJobCond;         // Signals when there's a new job to be processed
+    std::mutex              workMutex;          // Guards shutdown and noJobCond
+    EventCount              newJobEvent;        // Parked workers wait here for a new job
+    EventCount              newUrgentJobEvent;  // Parked reserved workers wait here for a PRIORITY_HIGH job
     std::condition_variable noJobCond;          // Signals when all threads are not working
-    std::queue<job>         jobQueue;
-    bool                    stop;
-    size_t                  workingCount;
-    size_t                  threadCount;
+    std::condition_variable startedCond;        // Signals when a worker has set itself up
+    std::condition_variable monitorCond;        // Wakes up the monitor to stop
+    jobLane                 lanes[PRIORITY_COUNT];
+    std::vector<std::atomic<workerInfo *>> workers;     // One slot per possible worker, NULL until it first starts
+    std::vector<std::thread> threads;           // Same slots. Joined when the slot is reused or the pool stops
+    std::vector<bool>       slotUsed;           // A worker runs in the slot, guarded by workMutex
+    std::thread             monitorThread;      // Grows the pool, see elasticPolicy
+    std::atomic<bool>       stop{false};
+    std::atomic<bool>       discardJobs{false};  // Stop without finishing the queued jobs
+    std::atomic<size_t>     workingCount{0};
+    std::atomic<size_t>     threadCount{0};
+    std::atomic<size_t>     queuedCount{0};     // Jobs waiting in any queue
+    std::atomic<size_t>     unfinishedCount{0}; // Jobs queued or running
+    std::atomic<size_t>     spinningCount{0};   // Idle workers spinning or yielding, not parked
+    std::atomic<size_t>     reservedSpinningCount{0};  // The same, of the reserved workers
+    std::atomic<unsigned>   spinLimit{64};      // See idlePolicy
+    std::atomic<unsigned>   yieldLimit{8};
+    std::atomic<unsigned long long> wakeupCount{0};
+    std::atomic<unsigned long long> growCount{0};       // See poolStats
+    std::atomic<unsigned long long> retireCount{0};
+    std::atomic<unsigned long long> queueWait{0};
+    bool                    trackingWait = false;   // See trackQueueWait, guarded by workMutex
+    std::atomic<double>     jobInterval{0};     // Microseconds between jobs finishing while jobs wait, 0 if unknown
+    std::atomic<double>     stalledFor{0};      // Microseconds since a job last finished while jobs were queued
     size_t                  maxJobCount;
+    size_t                  reservedCount = 0;  // See setReservedWorkers
+    size_t                  startedCount = 0;   // Workers set up so far, guarded by workMutex
+    std::atomic<bool>       multiNode{false};   // Workers are pinned to more than one NUMA node
+    affinityPolicy          affinity;
+    elasticPolicy           elastic = { 0, 0, 10000, 30000, 10 };
+
+    // Runs shutdown() unless it was called already, finishing the jobs still queued
+    ~ThreadPool();
 
     /*
     Function:   init
     Desc:       Initialize the thread pool
     Args:       threadCount: Optional. Specify the number of threads. Default is the number
-    .                        of concurrent threads supported by the implementation
-    .           maxJobCount: Optional. Specify the maximum number of jobs in the queue.
-    .                        Default is 0, which means no limitation
+    .                        of concurrent threads supported by the implementation. With an
+    .                        elasticPolicy, the number to start with
+    .           maxJobCount: Optional. Specify the maximum number of jobs in the queue of each
+    .                        priority lane that has no limit of its own (see setLaneLimit).
+    .                        Default is 0, which means no limitation. With a limit, jobs from
+    .                        outside the pool go through a lock-free ring, so addJob never
+    .                        takes a lock
+    .           affinity: Optional. Where to pin the workers, see affinityPolicy. Default is not to pin
+    .                     them. Idle workers steal from workers on their own NUMA node first
     WARNING:    For each ThreadPool class, this function should be called once only!
     */
-    void init(size_t threadCount = std::thread::hardware_concurrency(), size_t maxJobCount = 0);
+    void init(size_t threadCount = std::thread::hardware_concurrency(), size_t maxJobCount = 0,
+        const affinityPolicy &affinity = affinityPolicy());
 
     /*
     Function:   shutdown
-    Desc:       Terminate the thread pool
+    Desc:       Terminate the thread pool and wait for the threads to exit
     Args:       finishRemainingJobs: Optional. Determines whether the remaining jobs in the queue
     .                                will be finished before terminating or not
     */
@@ -50,17 +441,291 @@ public:
 
     /*
     Function:   addJob
-    Desc:       Add a new job into the queue
+    Desc:       Add a new job into the queue. A PRIORITY_NORMAL job added from one of the pool's own
+    .           threads goes to that thread's deque, where idle threads can steal it. Other jobs go to
+    .           the shared queue of their lane
     Args:       newJob: A job element, specifies the handler function and arguments.
     .                   E.g. addJob(job(handler, args));
+    .           priority: Optional. The lane to queue the job in. Default is PRIORITY_NORMAL
     Return:     If the job element is added to the queue, true is returned. If the
-    .           element is not added because the queue is full, false is returned
+    .           element is not added because the lane is full or the pool is shut down,
+    .           false is returned
+    Note:       Wakes a worker only if one is parked. In a lane without a limit, a job from outside
+    .           the pool briefly takes the lane's mutex
+    */
+    bool addJob(job newJob, jobPriority priority = PRIORITY_NORMAL);
+
+    /*
+    Function:   setLaneLimit
+    Desc:       Set the maximum number of jobs queued in one priority lane, instead of init's maxJobCount
+    Args:       priority: The lane
+    .           maxJobCount: 0 means no limitation
+    WARNING:    Call it before init
+    */
+    void setLaneLimit(jobPriority priority, size_t maxJobCount);
+
+    /*
+    Function:   setReservedWorkers
+    Desc:       Keep some workers for PRIORITY_HIGH jobs only, so they find an idle worker even while
+    .           normal and bulk jobs keep all the others busy. Default is 0
+    Args:       count: Number of reserved workers. At least one worker is always left for the other lanes
+    WARNING:    Call it before init
+    */
+    void setReservedWorkers(size_t count);
+
+    /*
+    Function:   setElasticPolicy
+    Desc:       Let the pool start workers when jobs wait too long and stop idle ones, see elasticPolicy.
+    .           By default the pool keeps the threadCount passed to init
+    Args:       policy: See elasticPolicy. minThreads is raised to keep one worker besides the reserved
+    .                   ones (see setReservedWorkers), which are never stopped
+    WARNING:    Call it before init
+    */
+    void setElasticPolicy(const elasticPolicy &policy);
+
+    /*
+    Function:   setIdlePolicy
+    Desc:       Set how workers wait for a job once they run out of them. Can be called any time
+    Args:       policy: See idlePolicy
+    */
+    void setIdlePolicy(const idlePolicy &policy);
+
+    /*
+    Function:   getStats
+    Desc:       Read the counters of the idle strategy, summed over all workers. Producers only wake a
+    .           worker when one is parked and none is spinning, so a low wakeups to jobs ratio is good
+    Return:     See poolStats
     */
-    bool addJob(job newJob);
+    poolStats getStats();
+
+    /*
+    Function:   estimateQueueWait
+    Desc:       Estimate how long a job added now would wait before a worker picks it up: the queued jobs
+    .           divided by the rate workers finish them, or the time since a job last finished if none do
+    Return:     In microseconds. 0 while nothing is queued
+    Note:       Lock-free, cheap enough to call for every request. The queued jobs are counted on every call,
+    .           so a burst shows up at once. The rate is measured every elasticPolicy tick by the monitor
+    .           thread, which only runs in an elastic pool or after trackQueueWait. Without it, or until
+    .           workers have been busy for a tick, the rate is unknown and only a stall shows up
+    */
+    unsigned long long estimateQueueWait();
+
+    /*
+    Function:   trackQueueWait
+    Desc:       Measure the rate workers finish jobs even if the pool isn't elastic, for estimateQueueWait.
+    .           Starts the monitor thread, or lets init start it when called before. RESTserver calls it for
+    .           routes with a queue wait budget
+    */
+    void trackQueueWait();
+
+    /*
+    Function:   parallelFor
+    Desc:       Call body(i) for every i in [begin, end). The range is split into chunks that idle workers
+    .           and the calling thread take one at a time. The caller runs chunks rather than blocking,
+    .           and returns once all of them are done
+    Args:       begin, end: The range
+    .           body: Called with each index, from several threads at the same time
+    .           grain: Optional. Indices per chunk. Default is 0, which makes 4 chunks per worker
+    Note:       An exception thrown by body stops the chunks not started yet and is rethrown here
+    */
+    template <typename Index, typename Body>
+    void parallelFor(Index begin, Index end, Body body, size_t grain = 0) {
+        if (!(begin < end)) {
+            return;
+        }
+        size_t count = (size_t)(end - begin);
+        grain = this->chunkSize(count, grain);
+        auto chunk = [&](size_t index) {
+            Index first = begin + (Index)(index * grain);
+            Index last = count - index * grain > grain ? first + (Index)grain : end;
+            for (Index i = first; i < last; i++) {
+                body(i);
+            }
+        };
+        this->forkJoin((count + grain - 1) / grain, &ThreadPool::callChunk<decltype(chunk)>, &chunk);
+    }
+
+    /*
+    Function:   parallelReduce
+    Desc:       Combine map(i) for every i in [begin, end), split into chunks like parallelFor. Each chunk is
+    .           reduced on its own, then the chunks' results are combined in order, so the result is the
+    .           same on every run even for floating point numbers
+    Args:       begin, end: The range
+    .           identity: The value combine leaves unchanged, e.g. 0 for a sum
+    .           map: Called with each index, from several threads at the same time
+    .           combine: Combine two values, must be associative
+    .           grain: Optional. Indices per chunk. Default is 0, which makes 4 chunks per worker
+    Return:     The combined value
+    Note:       An exception thrown by map or combine stops the chunks not started yet and is rethrown here
+    */
+    template <typename Index, typename T, typename Map, typename Combine>
+    T parallelReduce(Index begin, Index end, T identity, Map map, Combine combine, size_t grain = 0) {
+        if (!(begin < end)) {
+            return identity;
+        }
+        size_t count = (size_t)(end - begin);
+        grain = this->chunkSize(count, grain);
+        // One T per slot, a std::vector<bool> would pack the chunks' results into shared words. Each slot
+        // on its own cache line, so workers finishing neighbouring chunks don't invalidate each other's
+        struct alignas(64) partialSlot {
+            T value;
+        };
+        std::vector<partialSlot> partials((count + grain - 1) / grain, partialSlot{identity});
+        auto chunk = [&](size_t index) {
+            Index first = begin + (Index)(index * grain);
+            Index last = count - index * grain > grain ? first + (Index)grain : end;
+            T value = identity;
+            for (Index i = first; i < last; i++) {
+                value = combine(value, map(i));
+            }
+            partials[index].value = value;
+        };
+        this->forkJoin(partials.size(), &ThreadPool::callChunk<decltype(chunk)>, &chunk);
+
+        T result = identity;
+        for (partialSlot &partial : partials) {
+            result = combine(result, partial.value);
+        }
+        return result;
+    }
+
+#if defined(__cpp_impl_coroutine)
+    /*
+    Function:   schedule
+    Desc:       In a C++20 coroutine, co_await threadPool.schedule() continues on a worker
+    Args:       priority: Optional. The lane to queue the coroutine in. Default is PRIORITY_NORMAL
+    Return:     An awaitable
+    Note:       If the lane is full or the pool is shut down, the coroutine continues where it is
+    */
+    auto schedule(jobPriority priority = PRIORITY_NORMAL) {
+        struct awaiter {
+            ThreadPool  *pool;
+            jobPriority priority;
+
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> handle) {
+                // The worker may resume the coroutine before this returns, don't touch the awaiter after
+                return this->pool->addJob([handle] { handle.resume(); }, this->priority);
+            }
+            void await_resume() const noexcept {}
+        };
+        return awaiter{ this, priority };
+    }
+#endif
 
     /*
     Function:   waitForAllJobsDone
     Desc:       Wait until the working queue is empty and no thread is working
     */
     void waitForAllJobsDone();
+
+    // For internal use only. Pin the worker and set up its state, or reuse the state of the slot
+    workerInfo *startWorker(size_t index);
+
+    // For internal use only. Stop a worker that has been idle for the elasticPolicy's idleTimeout, unless
+    // the pool is at minThreads or there's a job to do. Return whether it should exit
+    bool retireWorker(size_t index);
+
+    // For internal use only. Estimate the queue wait every tick and start workers, see elasticPolicy
+    void monitor();
+
+    // For internal use only. Find a job for a worker, false if there's none
+    bool findJob(size_t index, job &found);
+
+    // For internal use only. Run a job taken from a queue
+    void runJob(job &currentJob);
+
+    // For internal use only. Count a job as no longer queued or running, waking waitForAllJobsDone on the last
+    void finishJob();
+
+    // For internal use only. Whether every queue the worker takes jobs from looks empty
+    bool looksEmpty(size_t index);
+
+    // For internal use only. Wake up a parked worker for a new job, unless one is spinning anyway
+    void wakeWorker(jobPriority priority);
+
+    // For internal use only. Wait for a job as set by setIdlePolicy, without parking. False if none came
+    bool spinForJob(size_t index, job &found);
+
+    // For internal use only. Run chunks until none is left. The caller of forkJoin and the jobs helping it run this
+    static void runChunks(forkJoinState &state);
+
+private:
+    // Run chunks [0, chunks) with runChunk(context, chunk) on the calling thread and idle workers
+    void forkJoin(size_t chunks, void (*runChunk)(void *context, size_t chunk), void *context);
+
+    // Indices per chunk of a range of count indices. grain if not 0
+    size_t chunkSize(size_t count, size_t grain);
+
+    template <typename Chunk>
+    static void callChunk(void *context, size_t chunk) {
+        (*static_cast<Chunk *>(context))(chunk);
+    }
+
+    // Add to / take from the ring of a lane. The lane's mutex must be held
+    void pushShared(jobLane &lane, job &&newJob);
+    job popShared(jobLane &lane);
+
+    // Take a job from a lane's shared queue. From the PRIORITY_NORMAL lane, a worker also moves a
+    // batch more into its own deque
+    bool takeShared(jobPriority priority, workerInfo *self, job &found);
+
+    // Start workers in free slots. workMutex must be held
+    void spawnWorkers(size_t count);
+
+    // Wrap a job in a node for a worker's deque / unwrap it, recycling the node
+    jobNode *allocNode(workerInfo *self, job &&newJob);
+    void releaseNode(workerInfo *self, jobNode *node, job &found);
 };
+
+/*
+Class:  TaskGroup
+Desc:   A set of tasks run on a thread pool, which wait() waits for. A task that no worker has picked up
+.       yet is run by the waiting thread itself, so wait() never blocks on a busy pool, it only waits
+.       for tasks other threads are already running.
+.       E.g. TaskGroup group(threadPool);
+.            group.run([&] { left = sum(a); });
+.            group.run([&] { right = sum(b); });
+.            group.wait();
+Note:   run and wait are called from the thread that owns the group
+*/
+class TaskGroup {
+public:
+    TaskGroup(ThreadPool &pool);
+
+    // Waits for the tasks. Their exceptions are dropped, call wait() to get them
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    // Queue a task. Any callable, like addJob
+    template <typename F>
+    void run(F &&task) {
+        this->submit(job(std::forward<F>(task)));
+    }
+
+    // Run the tasks nobody has started, wait for the others. Rethrows the first exception a task threw
+    void wait();
+
+private:
+    struct task {
+        std::atomic<bool>   claimed{false};     // A thread has started it
+        job                 work;
+    };
+    struct groupState {
+        std::atomic<size_t> pending{0};         // Tasks not finished
+        std::mutex          errorMutex;
+        std::exception_ptr  error;              // Guarded by errorMutex
+        EventCount          done;               // wait() sleeps here for pending to reach 0
+    };
+
+    ThreadPool                          &pool;
+    std::shared_ptr<groupState>         state;  // Outlives the group while queued jobs still refer to it
+    std::vector<std::shared_ptr<task>>  tasks;
+
+    void submit(job &&work);
+    static void execute(groupState &state, task &work);
+};
+
+#endif
@@ -9,37 +9,17 @@ Desc:   Test the functionality of the server, thread pool, and the json library
 #include "utils/json.hpp"
 #include <signal.h>
 
-#if !defined(_MSC_VER)
-#define _strdup strdup
-#define closesocket close
-#endif
-
 RESTserver server;
 ThreadPool threadPool;
 using json = nlohmann::json;
 
-typedef struct _response {
-    char *data;
-    int httpCode;
-    char *headers;
-} response;
-
-typedef struct _calc_param {
-    double  val;
-    int     socket;
-} calc_param;
-
-static void handleCalc(void *calcParam) {
-    calc_param *param = (calc_param*)calcParam;
-    response res;
-    res.data = _strdup(std::to_string(param->val + 10).c_str());
-    res.headers = _strdup("");
-    res.httpCode = 200;
-    send(param->socket, (char *)&res, sizeof(res), 0);
-    closesocket(param->socket);
+static void handleCalc(mg_http_message *request, asyncResponse *response, void *userdata) {
+    char buf[10];
+    mg_http_get_var(&request->query, "value", buf, 10);
+    response->body = std::to_string(atof(buf) + 10);
 }
 
-static void handleJson(void *socket) {
+static void handleJson(mg_http_message *request, asyncResponse *response, void *userdata) {
     json j = {
         {"pi", 3.141},
         {"happy", true},
@@ -54,13 +34,19 @@ static void handleJson(void *socket) {
           {"value", 42.99}
         }}
     };
-    response res;
-    res.data = _strdup(j.dump().c_str());
-    res.httpCode = 200;
-    res.headers = _strdup("Content-Type: application/json\r\n");
-    send((int)(long)socket, (char *)&res, sizeof(res), 0);
-    closesocket((int)(long)socket);
+    response->headers = "Content-Type: application/json\r\n";
+    response->body = j.dump();
+}
+
+#if defined(__cpp_impl_coroutine)
+static asyncTask handleGreet(requestContext &context) {
+    co_await context.sleep(10);             // A timer on the event loop, no thread waits for it
+    co_await threadPool.schedule();         // Go on on a worker
+    std::string greeting = "Hello from a worker";
+    asyncResponse hello = co_await context.fetch("http://localhost:8000/hello");    // Back on the event loop
+    context.response.body = greeting + ", and " + hello.body + " from /hello";
 }
+#endif
 
 int main() {
     server.setDefaultHandler(
@@ -75,36 +61,8 @@ int main() {
         }
     );
 
-    server.setPollHandler(
-        [](struct mg_connection *connection, int ev, mg_http_message *ev_data, void *fn_data) {
-            if (connection->socketpair_socket != 0) {
-                response res = { 0 };
-                if (recv(connection->socketpair_socket, (char *)&res, sizeof(res), 0) == sizeof(res)) {
-                    mg_http_reply(connection, res.httpCode, res.headers, res.data);
-                    closesocket(connection->socketpair_socket);
-                    connection->socketpair_socket = 0;
-                    free(res.data);
-                    free(res.headers);
-                }
-            }
-        }
-    );
-
-    server.addHandler("GET", "/calc",
-        [](struct mg_connection *connection, int ev, mg_http_message *ev_data, void *fn_data) {
-            char buf[10];
-            int len = mg_http_get_var(&ev_data->query, "value", buf, 10);
-            double n = atof(buf);
-            int blocking = -1, non_blocking = -1;
-
-            mg_socketpair(&blocking, &non_blocking);
-            static calc_param param;
-            param.val = n;
-            param.socket = blocking;
-            connection->socketpair_socket = non_blocking;
-            threadPool.addJob(job(handleCalc, (void *)&param));
-        }
-    );
+    // Turned away with 503 once a request would wait more than 200 ms for a worker
+    server.addAsyncHandler("GET", "/calc", handleCalc, PRIORITY_NORMAL, 200);
 
     server.addHandler("GET", "/hello",
         [](struct mg_connection *connection, int ev, mg_http_message *ev_data, void *fn_data) {
@@ -112,15 +70,11 @@ int main() {
         }
     );
 
-    server.addHandler("GET", "/testjson",
-        [](struct mg_connection *connection, int ev, mg_http_message *ev_data, void *fn_data) {
-            int blocking = -1, non_blocking = -1;
+    server.addAsyncHandler("GET", "/testjson", handleJson, PRIORITY_HIGH);
 
-            mg_socketpair(&blocking, &non_blocking);
-            connection->socketpair_socket = non_blocking;
-            threadPool.addJob(job(handleJson, (void *)blocking));
-        }
-    );
+#if defined(__cpp_impl_coroutine)
+    server.addCoroutineHandler("GET", "/greet", handleGreet);
+#endif
 
     server.addHandler("GET", "/wait",
         [](struct mg_connection *connection, int ev, mg_http_message *ev_data, void *fn_data) {
@@ -135,7 +89,8 @@ int main() {
             server.stopServer();
         }
     );
-    threadPool.init(8);
+    threadPool.init(8, 4096);
+    server.setThreadPool(&threadPool);
     server.startServer("localhost:8000", 50, NULL);
     threadPool.shutdown();
     printf("All clear! See you next time!\n");